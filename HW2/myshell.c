@@ -1,22 +1,188 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 
 // 205817893
 
+#define STATS_ENV "MYSHELL_STATS"
+#define PIPE_SIZE_ENV "MYSHELL_PIPE_SIZE"
+#define PIPE_OPERATOR "|"
+#define FANOUT_OPERATOR "|+"
+#define MAX_TRACKED_COMMANDS 128
+#define MAX_TRACKED_JOBS 256
+#define HISTOGRAM_BUCKETS 32
+#define COMMAND_NAME_LEN 64
+
+/*
+ * Accumulated usage of every run of one command name.
+ * Histogram bucket i counts runs which took [2^i, 2^(i+1)) microseconds.
+ */
+typedef struct command_stats{
+    char name[COMMAND_NAME_LEN];
+    long runs;
+    long long wall_us;
+    long long user_us;
+    long long sys_us;
+    long max_rss_kb;
+    long histogram[HISTOGRAM_BUCKETS];
+}command_stats;
+
+/*
+ * Background job waiting to be reaped by the SIGCHLD handler.
+ */
+typedef struct background_job{
+    pid_t pid;
+    char name[COMMAND_NAME_LEN];
+    struct timespec start;
+}background_job;
+
+/*
+ * Usage of a whole foreground job, summed over all of its processes. Used by "time".
+ */
+typedef struct job_usage{
+    long long wall_us;
+    long long user_us;
+    long long sys_us;
+    long max_rss_kb;
+}job_usage;
+
+/*
+ * Stats tables. Shared with the SIGCHLD handler, so the main loop only touches them while SIGCHLD is blocked.
+ */
+static command_stats stats_table[MAX_TRACKED_COMMANDS];
+static int stats_count = 0;
+static background_job jobs[MAX_TRACKED_JOBS];
+static int stats_enabled = 0;
+
+/*
+ * Size of every pipe the shell creates, 0 to keep the system default.
+ */
+static int pipe_size = 0;
+
+static long long timeval_to_us(struct timeval tv){
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Microseconds passed since start.
+ */
+static long long elapsed_us(const struct timespec* start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Finding the stats entry of a command, creating it if needed. Returns NULL when the table is full.
+ */
+static command_stats* get_command_stats(const char* name){
+    for(int i = 0; i < stats_count; i++){
+        if(strncmp(stats_table[i].name, name, COMMAND_NAME_LEN - 1) == 0)
+            return &stats_table[i];
+    }
+    if(stats_count == MAX_TRACKED_COMMANDS)
+        return NULL;
+
+    command_stats* entry = &stats_table[stats_count++];
+    strncpy(entry->name, name, COMMAND_NAME_LEN - 1);
+    return entry;
+}
+
+/*
+ * Adding one finished process to the stats of its command.
+ */
+static void record_command(const char* name, long long wall_us, const struct rusage* usage){
+    if(!stats_enabled)
+        return;
+
+    command_stats* entry = get_command_stats(name);
+    if(entry == NULL)
+        return;
+
+    int bucket = 0;
+    while(bucket < HISTOGRAM_BUCKETS - 1 && (wall_us >> (bucket + 1)) > 0)
+        bucket++;
+
+    entry->runs++;
+    entry->histogram[bucket]++;
+    entry->wall_us += wall_us;
+    entry->user_us += timeval_to_us(usage->ru_utime);
+    entry->sys_us += timeval_to_us(usage->ru_stime);
+    if(usage->ru_maxrss > entry->max_rss_kb)
+        entry->max_rss_kb = usage->ru_maxrss;
+}
+
+/*
+ * Remembering a background job so its usage can be recorded once it is reaped.
+ * Called with SIGCHLD blocked.
+ */
+static void register_background_job(pid_t pid, const char* name, const struct timespec* start){
+    if(!stats_enabled)
+        return;
+
+    for(int i = 0; i < MAX_TRACKED_JOBS; i++){
+        if(jobs[i].pid == 0){
+            jobs[i].pid = pid;
+            strncpy(jobs[i].name, name, COMMAND_NAME_LEN - 1);
+            jobs[i].start = *start;
+            return;
+        }
+    }
+}
+
+/*
+ * Recording a reaped background job. Called from the SIGCHLD handler.
+ */
+static void record_background_job(pid_t pid, const struct rusage* usage){
+    for(int i = 0; i < MAX_TRACKED_JOBS; i++){
+        if(jobs[i].pid == pid){
+            record_command(jobs[i].name, elapsed_us(&jobs[i].start), usage);
+            jobs[i].pid = 0;
+            return;
+        }
+    }
+}
+
 /*
  * Allowing child signal to run.
  */
 void sig_handler(int signal){
-    while(waitpid((pid_t)(-1),NULL, WNOHANG) != -1){};
-    if(errno != EINTR && errno != ECHILD){
+    int saved_errno = errno;
+    struct rusage usage;
+    pid_t pid;
+
+    while((pid = wait4((pid_t)(-1), NULL, WNOHANG, &usage)) > 0){
+        record_background_job(pid, &usage);
+    }
+    if(pid == -1 && errno != EINTR && errno != ECHILD){
         perror("Error in waiting for child process.");
         exit(1);
     }
+    errno = saved_errno;
+}
+
+/*
+ * Foreground jobs are waited with SIGCHLD blocked, so the handler can't reap them before wait4().
+ */
+static void block_sigchld(sigset_t* old_mask){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, old_mask);
+}
+
+static void restore_sigmask(const sigset_t* old_mask){
+    sigprocmask(SIG_SETMASK, old_mask, NULL);
 }
 
 /*
@@ -36,17 +202,59 @@ void restoring_sigint_signal(){
  * Executing command and checking if errors happened.
  */
 void execute_command_and_check_error(char** arguments){
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL); //Child shouldn't inherit our blocked SIGCHLD.
+
     execvp(arguments[0], arguments);
     perror("Error in executing command.");
     exit(1);
 }
 
+/*
+ * Waiting for one foreground process and accounting its usage.
+ */
+static int wait_for_child(pid_t pid, const char* name, const struct timespec* start, job_usage* total){
+    struct rusage usage;
+    pid_t ret;
+
+    do{
+        ret = wait4(pid, NULL, WUNTRACED, &usage);
+    }while(ret == -1 && errno == EINTR);
+    if(ret == -1)
+        return 0;
+
+    long long wall_us = elapsed_us(start);
+    record_command(name, wall_us, &usage);
+
+    if(wall_us > total->wall_us)
+        total->wall_us = wall_us;
+    total->user_us += timeval_to_us(usage.ru_utime);
+    total->sys_us += timeval_to_us(usage.ru_stime);
+    if(usage.ru_maxrss > total->max_rss_kb)
+        total->max_rss_kb = usage.ru_maxrss;
+    return 1;
+}
+
+/*
+ * Output of the "time" builtin.
+ */
+static void print_time_report(const job_usage* total){
+    fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\nmaxrss\t%ldKB\n",
+            total->wall_us / 1e6, total->user_us / 1e6, total->sys_us / 1e6, total->max_rss_kb);
+}
+
 /*
  * For process which ends with "&".
  */
 int background_worker(char** arglist, int count){
-    int pid = fork();
+    sigset_t old_mask;
+    struct timespec start;
+
     arglist[count - 1] = NULL; //We ignore "&"
+    block_sigchld(&old_mask);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int pid = fork();
     if(pid < 0){ //fork failed
         perror("Failed to conduct fork() function.");
         exit(1);
@@ -54,13 +262,22 @@ int background_worker(char** arglist, int count){
         execute_command_and_check_error(arglist);
     }
 
+    register_background_job(pid, arglist[0], &start);
+    restore_sigmask(&old_mask);
     return 1;
 }
 
 /*
  * Regular process. Shell waits until it's finished.
  */
-int regular_worker(char** arglist){
+int regular_worker(char** arglist, int timed){
+    sigset_t old_mask;
+    struct timespec start;
+    job_usage total = {0};
+    int ret = 1;
+
+    block_sigchld(&old_mask);
+    clock_gettime(CLOCK_MONOTONIC, &start);
     pid_t pid = fork();
     if(pid < 0){ //fork failed
         printf("Failed to conduct fork() function.");
@@ -69,76 +286,266 @@ int regular_worker(char** arglist){
         restoring_sigint_signal();
         execute_command_and_check_error(arglist);
     }else{
-        if(waitpid(pid,NULL,WUNTRACED) == -1){ //Wait for process.
-            return 0;
-        }
+        ret = wait_for_child(pid, arglist[0], &start, &total); //Wait for process.
+    }
+    restore_sigmask(&old_mask);
+
+    if(ret && timed)
+        print_time_report(&total);
+    return ret;
+}
+
+
+/*
+ * Applying the configured pipe size. Failure is not fatal, the pipe just keeps its default size.
+ */
+static void resize_pipe(int fd){
+    if(pipe_size > 0 && fcntl(fd, F_SETPIPE_SZ, pipe_size) == -1){
+        perror("Error in setting pipe size");
+        pipe_size = 0; //Don't repeat the warning for every pipe.
     }
-    return 1;
 }
 
+/*
+ * Closing all pipes of a pipeline.
+ */
+static void close_pipes(int (*pipes)[2], int count){
+    for(int i = 0; i < count; i++){
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+}
+
+/*
+ * Opening count pipes. Returns 0 on success.
+ */
+static int open_pipes(int (*pipes)[2], int count){
+    for(int i = 0; i < count; i++){
+        if(pipe(pipes[i]) == -1){
+            close_pipes(pipes, i);
+            return 1;
+        }
+        resize_pipe(pipes[i][1]);
+    }
+    return 0;
+}
 
 /*
- * Setting the reading end of the pipeline.
+ * Connecting a pipeline stage to its pipe ends and executing it. in_fd/out_fd are -1 to keep stdin/stdout.
  */
-void reading_end(int* pipefd, char** arglist){
-    dup2(pipefd[0], STDIN_FILENO);
-    close(pipefd[0]);
-    close(pipefd[1]);
+void stage_end(int in_fd, int out_fd, int (*pipes)[2], int count, char** arglist){
+    if(in_fd != -1)
+        dup2(in_fd, STDIN_FILENO);
+    if(out_fd != -1)
+        dup2(out_fd, STDOUT_FILENO);
+    close_pipes(pipes, count);
     restoring_sigint_signal();
     execute_command_and_check_error(arglist);
 }
 
 /*
- * Setting the writing end of the pipeline.
+ * Waiting for all stages of a pipeline.
  */
-void writing_end(int* pipefd, char** arglist, int pointer){
-    dup2(pipefd[1], STDIN_FILENO);
-    close(pipefd[0]);
-    close(pipefd[1]);
+static int wait_for_stages(pid_t* pids, char*** stages, int count, int timed, const struct timespec* start){
+    job_usage total = {0};
+    int ret = 1;
 
-    //We need to set the second set of instructions.
-    //We do it with pointer arithmetic.
-    char** second_argument = arglist + pointer +1;
-    restoring_sigint_signal();
-    execute_command_and_check_error(second_argument);
+    for(int i = 0; i < count; i++){
+        if(!wait_for_child(pids[i], stages[i][0], start, &total))
+            ret = 0;
+    }
+    if(ret && timed)
+        print_time_report(&total);
+    return ret;
 }
 
 /*
- * Pipeline process. Working in the background.
+ * Pipeline process. Stage i reads from pipe i-1 and writes to pipe i.
  */
-int pipeline_worker(char** arglist, int pointer){
-    int pipefd[2];
-    if(pipe(pipefd)==-1){
+int pipeline_worker(char*** stages, int count, int timed){
+    sigset_t old_mask;
+    struct timespec start;
+    int pipes[count - 1][2];
+    pid_t pids[count];
+
+    if(open_pipes(pipes, count - 1)){
         perror("Error in pipe() function");
         exit(1);
     }
 
-    pid_t pid = fork();
+    block_sigchld(&old_mask);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    if(pid < 0){
+    for(int i = 0; i < count; i++){
+        pids[i] = fork();
+        if(pids[i] < 0){
+            perror("Failed to conduct fork() function inside pipeline.");
+            exit(1);
+        }else if(pids[i] == 0){
+            stage_end(i > 0 ? pipes[i - 1][0] : -1, i < count - 1 ? pipes[i][1] : -1,
+                      pipes, count - 1, stages[i]);
+        }
+    }
+
+    //Parent must drop every end, otherwise readers never see EOF.
+    close_pipes(pipes, count - 1);
+
+    int ret = wait_for_stages(pids, stages, count, timed, &start);
+    restore_sigmask(&old_mask);
+    return ret;
+}
+
+/*
+ * Moving exactly length bytes from one pipe to another fd. Returns 0 when the other side is gone.
+ */
+static int splice_all(int in_fd, int out_fd, ssize_t length){
+    while(length > 0){
+        ssize_t moved = splice(in_fd, NULL, out_fd, NULL, length, SPLICE_F_MOVE);
+        if(moved <= 0){
+            if(moved == -1 && errno == EINTR)
+                continue;
+            return 0;
+        }
+        length -= moved;
+    }
+    return 1;
+}
+
+/*
+ * Throwing away whatever is left in a pipe, so bytes of a failed round don't reach the next consumer.
+ */
+static void drain_pipe(int in_fd, int null_fd){
+    int left = 0;
+    if(ioctl(in_fd, FIONREAD, &left) == 0 && left > 0)
+        splice_all(in_fd, null_fd, left);
+}
+
+/*
+ * Fan-out pump. Duplicates everything written to in_fd into every consumer pipe without copying it
+ * to user space: tee() clones the pipe buffers for all consumers but the last, and splice() moves them
+ * to the last one. tee() always starts at the head of the input, so when a consumer pipe only takes
+ * part of a chunk the rest is cloned into a scratch pipe, trimmed and spliced over.
+ */
+void fanout_pump(int in_fd, int* out_fds, int count){
+    int alive = count;
+    int scratch[2];
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    signal(SIGPIPE, SIG_IGN); //Gone consumers are reported by EPIPE.
+    if(null_fd == -1 || pipe(scratch) == -1){
+        perror("Error in preparing fan-out");
+        exit(1);
+    }
+    fcntl(scratch[1], F_SETPIPE_SZ, fcntl(in_fd, F_GETPIPE_SZ));
+
+    while(alive > 0){
+        ssize_t length = 0;
+        int last = -1;
+
+        //First live consumer decides how much this round moves.
+        for(int i = 0; i < count && length == 0; i++){
+            if(out_fds[i] == -1)
+                continue;
+            length = tee(in_fd, out_fds[i], INT_MAX, 0);
+            if(length == -1 && errno == EINTR){
+                length = 0;
+                i--;
+            }else if(length == -1){
+                close(out_fds[i]);
+                out_fds[i] = -1;
+                alive--;
+                length = 0;
+            }else if(length == 0){
+                exit(0); //Producer finished.
+            }else{
+                last = i;
+            }
+        }
+        if(length == 0)
+            break;
+
+        int final = count - 1;
+        while(final > last && out_fds[final] == -1)
+            final--;
+
+        for(int i = last + 1; i < final; i++){
+            if(out_fds[i] == -1)
+                continue;
+            ssize_t teed = tee(in_fd, out_fds[i], length, 0);
+            if(teed == length)
+                continue;
+            if(teed > 0 && tee(in_fd, scratch[1], length, 0) == length &&
+               splice_all(scratch[0], null_fd, teed) && splice_all(scratch[0], out_fds[i], length - teed))
+                continue;
+
+            drain_pipe(scratch[0], null_fd);
+            close(out_fds[i]);
+            out_fds[i] = -1;
+            alive--;
+        }
+
+        //The last consumer takes the chunk itself, which consumes it from the input.
+        if(final == last || !splice_all(in_fd, out_fds[final], length)){
+            if(final != last){
+                close(out_fds[final]);
+                out_fds[final] = -1;
+                alive--;
+            }
+            splice_all(in_fd, null_fd, length);
+        }
+    }
+
+    //Nobody listens anymore. Closing the input lets the producer get SIGPIPE.
+    exit(0);
+}
+
+/*
+ * Fan-out process. The first stage writes to the pump, and every other stage reads its own copy.
+ */
+int fanout_worker(char*** stages, int count, int timed){
+    sigset_t old_mask;
+    struct timespec start;
+    int pipes[count][2];
+    int out_fds[count - 1];
+    pid_t pids[count];
+
+    if(open_pipes(pipes, count)){
+        perror("Error in pipe() function");
+        exit(1);
+    }
+
+    block_sigchld(&old_mask);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pump = fork();
+    if(pump < 0){
         perror("Failed to conduct fork() function inside pipeline.");
         exit(1);
+    }else if(pump == 0){
+        for(int i = 1; i < count; i++){
+            out_fds[i - 1] = pipes[i][1];
+            close(pipes[i][0]);
+        }
+        close(pipes[0][1]);
+        fanout_pump(pipes[0][0], out_fds, count - 1);
     }
 
-    if(pid == 0){ //Child read from pipe.
-        reading_end(pipefd, arglist);
-    }else{ //Parent write to file
-        pid_t pid2 = fork();
-        if(pid < 0){
+    for(int i = 0; i < count; i++){
+        pids[i] = fork();
+        if(pids[i] < 0){
             perror("Failed to conduct fork() function inside pipeline.");
             exit(1);
-        }else if(pid == 0){ // Grandchild to write to pipe.
-            writing_end(pipefd, arglist, pointer);
-        }else{
-            if(waitpid(pid,NULL,WUNTRACED) == -1){ //Waiting for process.
-                return 0;
-            };
-            if(waitpid(pid2,NULL,WUNTRACED) == -1){ //Waiting for process.
-                return 0;
-            };
-            return 1;
+        }else if(pids[i] == 0){
+            stage_end(i > 0 ? pipes[i][0] : -1, i == 0 ? pipes[0][1] : -1, pipes, count, stages[i]);
         }
     }
+
+    close_pipes(pipes, count);
+
+    int ret = wait_for_stages(pids, stages, count, timed, &start);
+    while(waitpid(pump, NULL, 0) == -1 && errno == EINTR){};
+    restore_sigmask(&old_mask);
+    return ret;
 }
 
 
@@ -146,16 +553,47 @@ int pipeline_worker(char** arglist, int pointer){
  * arglist runner. Decides which tpye of process to run,
  */
 int process_arglist(int count, char** arglist){
+    int timed = 0;
+    if(strcmp(arglist[0], "time") == 0 && count > 1){ //"time" prefix builtin.
+        timed = 1;
+        arglist++;
+        count--;
+    }
+
     if(strcmp(arglist[count -1],"&") == 0) //Check if it is background process.
         return background_worker(arglist, count);
     else{
+        //Splitting arglist into stages. Operators are set to NULL for execvp() function.
+        char** stages[count];
+        int stage_count = 1, chained = 0, fanned = 0;
+        stages[0] = arglist;
         for(int i=0; i< count; i++){
-            if(strcmp(arglist[i],"|") == 0){
-                arglist[i] = NULL; //Setting it to NULL for execvp() function.
-                return pipeline_worker(arglist, i);
+            int chain = strcmp(arglist[i], PIPE_OPERATOR) == 0;
+            int fan = strcmp(arglist[i], FANOUT_OPERATOR) == 0;
+            if(chain || fan){
+                chained |= chain;
+                fanned |= fan;
+                arglist[i] = NULL;
+                stages[stage_count++] = arglist + i + 1;
+            }
+        }
+
+        for(int i = 0; i < stage_count; i++){
+            if(stages[i][0] == NULL){
+                fprintf(stderr, "Empty command in pipeline.\n");
+                return 1;
             }
         }
-        return regular_worker(arglist);
+        if(chained && fanned){
+            fprintf(stderr, "Can't mix \"%s\" and \"%s\" in one pipeline.\n", PIPE_OPERATOR, FANOUT_OPERATOR);
+            return 1;
+        }
+
+        if(fanned)
+            return fanout_worker(stages, stage_count, timed);
+        if(chained)
+            return pipeline_worker(stages, stage_count, timed);
+        return regular_worker(arglist, timed);
     }
 }
 
@@ -168,6 +606,7 @@ int init_sigaction(){
     //Prepare child
     child_sa.sa_handler = &sig_handler;
     child_sa.sa_flags = SA_RESTART;
+    sigemptyset(&child_sa.sa_mask);
     if(sigaction(SIGCHLD,&child_sa,0) == -1){ //error
         perror("Error in child sigaction");
         return 1;
@@ -187,14 +626,65 @@ int init_sigaction(){
 }
 
 int prepare(void){
+    stats_enabled = getenv(STATS_ENV) != NULL;
+    if(getenv(PIPE_SIZE_ENV) != NULL)
+        pipe_size = atoi(getenv(PIPE_SIZE_ENV));
     return init_sigaction();
 }
 
+/*
+ * Approximate percentile from a latency histogram, as the upper bound of the bucket holding it.
+ */
+static long long histogram_percentile(const command_stats* entry, double percentile){
+    long target = (long)(entry->runs * percentile);
+    long seen = 0;
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++){
+        seen += entry->histogram[i];
+        if(seen > target)
+            return 1LL << (i + 1);
+    }
+    return 1LL << HISTOGRAM_BUCKETS;
+}
+
+/*
+ * Writing per command stats to the file named by MYSHELL_STATS ("-" for stderr).
+ */
+static int dump_stats(void){
+    const char* path = getenv(STATS_ENV);
+    FILE* out = stderr;
+    sigset_t old_mask;
+
+    if(strcmp(path, "-") != 0 && (out = fopen(path, "w")) == NULL){
+        perror("Error in opening stats file");
+        return 1;
+    }
+
+    block_sigchld(&old_mask);
+    fprintf(out, "%-20s %8s %10s %10s %10s %10s %10s %10s\n",
+            "command", "runs", "avg_ms", "p50_ms", "p99_ms", "user_s", "sys_s", "maxrss_kb");
+    for(int i = 0; i < stats_count; i++){
+        const command_stats* entry = &stats_table[i];
+        fprintf(out, "%-20s %8ld %10.3f %10.3f %10.3f %10.3f %10.3f %10ld\n",
+                entry->name, entry->runs, entry->wall_us / 1e3 / entry->runs,
+                histogram_percentile(entry, 0.50) / 1e3, histogram_percentile(entry, 0.99) / 1e3,
+                entry->user_us / 1e6, entry->sys_us / 1e6, entry->max_rss_kb);
+        for(int b = 0; b < HISTOGRAM_BUCKETS; b++){
+            if(entry->histogram[b] != 0)
+                fprintf(out, "    [%lldus, %lldus) %ld\n", 1LL << b, 1LL << (b + 1), entry->histogram[b]);
+        }
+    }
+    restore_sigmask(&old_mask);
+
+    if(out != stderr)
+        fclose(out);
+    return 0;
+}
+
 /*
  * Stop shell.
  */
 int finalize(void){
+    if(stats_enabled)
+        return dump_stats();
     return 0;
 }
-
-
@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/*
+ * Benchmark driver for myshell. Every workload is written to the shell's stdin, and the shell's output
+ * is thrown away unless the workload needs it. Giving several shells runs every workload on each of
+ * them, so a change to process_arglist or the workers can be compared against the previous build.
+ *
+ * Build: gcc -O2 -Wall -std=gnu11 shell.c myshell.c -o myshell && gcc -O2 -Wall -std=gnu11 shell_bench.c -o shell_bench
+ * Usage: ./shell_bench [-n commands] [-b pipeline bytes] [-p pipe size] [myshell...]
+ */
+
+#define DEFAULT_SHELL "./myshell"
+#define DEFAULT_COMMANDS 2000
+#define DEFAULT_PIPELINE_BYTES (256L << 20)
+#define LINE_MAX_LEN 1024
+#define MAX_PIPELINE_STAGES 8
+
+static int commands = DEFAULT_COMMANDS;
+static long pipeline_bytes = DEFAULT_PIPELINE_BYTES;
+static const char* pipe_size = NULL;
+
+/*
+ * A running shell with both ends of its stdin and stdout.
+ */
+typedef struct shell_process{
+    pid_t pid;
+    int input;
+    FILE* output;
+}shell_process;
+
+static double now_seconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Starting a shell. Its stdout is only kept when capture is set.
+ */
+static shell_process start_shell(const char* shell_path, int capture){
+    shell_process shell = {0, -1, NULL};
+    int input[2], output[2];
+    if(pipe(input) == -1 || pipe(output) == -1){
+        perror("Error in pipe() function");
+        exit(1);
+    }
+
+    shell.pid = fork();
+    if(shell.pid < 0){
+        perror("Failed to conduct fork() function.");
+        exit(1);
+    }else if(shell.pid == 0){
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(input[0], STDIN_FILENO);
+        dup2(capture ? output[1] : null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO); //"time" reports would flood the benchmark output.
+        close(null_fd);
+        close(input[0]);
+        close(input[1]);
+        close(output[0]);
+        close(output[1]);
+        if(pipe_size != NULL)
+            setenv("MYSHELL_PIPE_SIZE", pipe_size, 1);
+        execl(shell_path, shell_path, (char*)NULL);
+        perror("Error in executing shell.");
+        exit(1);
+    }
+
+    close(input[0]);
+    close(output[1]);
+    shell.input = input[1];
+    shell.output = fdopen(output[0], "r");
+    return shell;
+}
+
+static void write_all(int fd, const char* text, size_t length){
+    for(size_t written = 0; written < length;){
+        ssize_t ret = write(fd, text + written, length - written);
+        if(ret == -1){
+            perror("Error in writing script");
+            exit(1);
+        }
+        written += ret;
+    }
+}
+
+/*
+ * Closing the shell's stdin and waiting for it to exit.
+ */
+static void stop_shell(shell_process* shell){
+    int status;
+    close(shell->input);
+    fclose(shell->output);
+    waitpid(shell->pid, &status, 0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        fprintf(stderr, "Shell exited abnormally.\n");
+        exit(1);
+    }
+}
+
+/*
+ * Running a whole script through a new shell and returning the wall time it took.
+ */
+static double run_script(const char* shell_path, const char* script){
+    double start = now_seconds();
+    shell_process shell = start_shell(shell_path, 0);
+    write_all(shell.input, script, strlen(script));
+    stop_shell(&shell);
+    return now_seconds() - start;
+}
+
+/*
+ * Script made of count copies of line.
+ */
+static char* repeat_line(const char* line, int count){
+    size_t length = strlen(line);
+    char* script = malloc(length * count + 1);
+    if(script == NULL){
+        fprintf(stderr, "Error in allocating script.\n");
+        exit(1);
+    }
+    for(int i = 0; i < count; i++)
+        memcpy(script + i * length, line, length);
+    script[length * count] = '\0';
+    return script;
+}
+
+/*
+ * Command rate of a script made of copies of lines. Every line counts as one command.
+ */
+static void throughput_workload(const char* shell_path, const char* name, const char* lines){
+    int per_copy = 0;
+    for(const char* c = lines; *c != '\0'; c++)
+        per_copy += *c == '\n';
+
+    //At least one copy, so a small -n still runs every line once.
+    int copies = commands / per_copy > 0 ? commands / per_copy : 1;
+    char* script = repeat_line(lines, copies);
+    double seconds = run_script(shell_path, script);
+    printf("  %-22s %10.0f commands/s\n", name, copies * per_copy / seconds);
+    free(script);
+}
+
+static int compare_doubles(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Launch latency. Commands are sent one at a time, and each one is timed from writing the line until
+ * its output shows up.
+ */
+static void latency_workload(const char* shell_path){
+    double* samples = malloc(commands * sizeof(double));
+    char line[LINE_MAX_LEN];
+    if(samples == NULL){
+        fprintf(stderr, "Error in allocating samples.\n");
+        exit(1);
+    }
+
+    shell_process shell = start_shell(shell_path, 1);
+    for(int i = 0; i < commands; i++){
+        int length = snprintf(line, sizeof(line), "echo %d\n", i);
+        double start = now_seconds();
+        write_all(shell.input, line, length);
+        if(fgets(line, sizeof(line), shell.output) == NULL){
+            fprintf(stderr, "Shell output ended early.\n");
+            exit(1);
+        }
+        samples[i] = now_seconds() - start;
+    }
+    stop_shell(&shell);
+
+    qsort(samples, commands, sizeof(double), compare_doubles);
+    printf("  %-22s p50 %8.1f us  p99 %8.1f us\n", "echo latency",
+           samples[commands / 2] * 1e6, samples[(int)(commands * 0.99)] * 1e6);
+    free(samples);
+}
+
+/*
+ * Moving pipeline_bytes through a pipeline of the given width joined by op.
+ * For "|" the middle stages are cat, for "|+" every consumer gets its own copy.
+ */
+static void pipeline_workload(const char* shell_path, int stages, const char* op){
+    char script[LINE_MAX_LEN];
+    int used = snprintf(script, sizeof(script), "head -c %ld /dev/zero", pipeline_bytes);
+    for(int i = 1; i < stages; i++){
+        const char* stage = (strcmp(op, "|") == 0 && i < stages - 1) ? "cat" : "wc -c";
+        used += snprintf(script + used, sizeof(script) - used, " %s %s", op, stage);
+    }
+    snprintf(script + used, sizeof(script) - used, "\n");
+
+    double seconds = run_script(shell_path, script);
+    printf("  %-8s %d stages %15.1f MB/s\n", strcmp(op, "|") == 0 ? "chain" : "fan-out", stages,
+           pipeline_bytes / seconds / 1e6);
+}
+
+static void run_workloads(const char* shell_path){
+    printf("%s (pipe size %s)\n", shell_path, pipe_size == NULL ? "default" : pipe_size);
+
+    throughput_workload(shell_path, "true", "true\n");
+    throughput_workload(shell_path, "background true", "true &\n");
+    throughput_workload(shell_path, "mixed builtins", "true\ntime true\ntrue | true\ntrue &\n");
+    latency_workload(shell_path);
+
+    for(int stages = 2; stages <= MAX_PIPELINE_STAGES; stages++)
+        pipeline_workload(shell_path, stages, "|");
+    pipeline_workload(shell_path, 3, "|+");
+    pipeline_workload(shell_path, 4, "|+");
+}
+
+int main(int argc, char* argv[]){
+    int opt;
+    while((opt = getopt(argc, argv, "n:b:p:")) != -1){
+        switch(opt){
+            case 'n':
+                commands = atoi(optarg);
+                break;
+            case 'b':
+                pipeline_bytes = atol(optarg);
+                break;
+            case 'p':
+                pipe_size = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n commands] [-b pipeline bytes] [-p pipe size] [myshell...]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if(commands <= 0 || pipeline_bytes <= 0){
+        fprintf(stderr, "Error in the benchmark arguments.\n");
+        exit(1);
+    }
+
+    if(optind == argc)
+        run_workloads(DEFAULT_SHELL);
+    for(int i = optind; i < argc; i++)
+        run_workloads(argv[i]);
+    return 0;
+}
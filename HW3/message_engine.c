@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+#include "message_engine.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ENGINE_MAGIC 0x6d736c6f74786131ULL
+#define ENGINE_ALIGN 64
+
+/*
+ * Index nodes have 64 entries, as xarray nodes. The height of a slot's tree is kept in the low bits of
+ * its root, which are free since everything in the mapping is ENGINE_ALIGN aligned.
+ */
+#define INDEX_SHIFT 6
+#define INDEX_SIZE (1 << INDEX_SHIFT)
+#define INDEX_MASK (INDEX_SIZE - 1)
+
+/*
+ * Payloads above the biggest class come from power of 2 pools, up to MAX_MSG_LIMIT.
+ */
+#define PAYLOAD_MIN_SHIFT 12
+#define PAYLOAD_MAX_SHIFT 20
+_Static_assert(MAX_MSG_LIMIT == 1 << PAYLOAD_MAX_SHIFT, "Payload pools must reach MAX_MSG_LIMIT.");
+
+/*
+ * Free list heads hold an offset and, above it, a count of changes, so a head that was popped and
+ * pushed back meanwhile doesn't pass the compare and swap.
+ */
+#define OFFSET_BITS 40
+#define OFFSET_MASK ((1ULL << OFFSET_BITS) - 1)
+#define TAG_ONE (1ULL << OFFSET_BITS)
+
+#define YIELD_SPINS 64           //Lock holders may be preempted, so waiters yield now and then.
+#define OWNER_CHECK_SPINS 4096   //Waiters check this often whether the lock owner still exists.
+
+static const unsigned int ClassBytes[] = MESSAGE_CLASS_BYTES;
+#define MESSAGE_CLASSES (sizeof(ClassBytes) / sizeof(ClassBytes[0]))
+#define PAYLOAD_POOLS (PAYLOAD_MAX_SHIFT - PAYLOAD_MIN_SHIFT + 1)
+#define ENGINE_POOLS (MESSAGE_CLASSES + 1 + PAYLOAD_POOLS) //Message classes, large headers, payloads.
+
+/*
+ * Free list of objects of one size. Objects are never returned to the arena, so they keep their type.
+ */
+typedef struct engine_pool{
+    __u64 head;
+    __u32 object_bytes;
+} __attribute__((aligned(64))) engine_pool;
+
+typedef struct engine_header{
+    __u64 magic;
+    __u64 bytes;         //Size of the whole mapping.
+    __u64 used;          //End of the allocated part. The rest is still zero.
+    __u32 slots;
+    __u32 max_msg_bytes;
+    engine_pool pools[ENGINE_POOLS];
+} engine_header;
+
+/*
+ * Channel index of a slot.
+ */
+typedef struct engine_slot{
+    __u64 root;      //Offset of the top index node with the tree height, 0 until the first channel.
+    __u32 lock;      //Serializes insertions, as the xarray lock.
+    __u32 count;     //Number of channels.
+} __attribute__((aligned(64))) engine_slot;
+
+typedef struct engine_index{
+    __u64 entries[INDEX_SIZE]; //Offsets of the index nodes one level down, or of channel nodes at the bottom.
+} engine_index;
+
+typedef struct engine_node{
+    __u64 channel;
+    __u64 last;     //Offset of the last message, 0 until the first write.
+    __u32 lock;     //Serializes writers of the channel.
+    __u32 refs;     //Taken by every request, as the driver's kref. Channels are never deleted, so it stays above 0.
+} __attribute__((aligned(64))) engine_node;
+
+/*
+ * Message is never changed after it is published, so readers copy it without locking.
+ */
+typedef struct engine_message{
+    __u64 next_free;    //Link in the free list of its class, where the driver keeps its rcu_head.
+    __u32 refs;
+    __u32 length;
+    __u32 size_class;
+    __u32 reserved;
+    __u64 msg;          //Offset of the payload, inline_msg unless the message is above the biggest class.
+    char inline_msg[];
+} engine_message;
+
+static void CpuRelax(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void* EngineAt(msg_engine* engine, __u64 offset){
+    return engine->base + offset;
+}
+
+static __u64 EngineOffset(msg_engine* engine, void* object){
+    return (char*)object - engine->base;
+}
+
+static size_t AlignUp(size_t bytes, size_t align){
+    return (bytes + align - 1) & ~(align - 1);
+}
+
+/*
+ * Taking a lock for pid. A lock whose owner died is taken over: every change made under a lock is
+ * published with one store, so the owner left either its change or memory nobody can reach.
+ */
+static void EngineLock(__u32* lock, pid_t pid){
+    unsigned long spins;
+    __u32 owner;
+
+    for(spins = 1;; spins++){
+        owner = 0;
+        if(__atomic_compare_exchange_n(lock, &owner, (__u32)pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            return;
+        }
+        if(spins % OWNER_CHECK_SPINS == 0 && kill((pid_t)owner, 0) < 0 && errno == ESRCH &&
+           __atomic_compare_exchange_n(lock, &owner, (__u32)pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            return;
+        }
+        if(spins % YIELD_SPINS == 0){
+            sched_yield();
+        }else{
+            CpuRelax();
+        }
+    }
+}
+
+static void EngineUnlock(__u32* lock){
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Taking bytes from the unallocated part of the mapping, which is still zero. Returns 0 when it is full.
+ */
+static __u64 AllocBytes(msg_engine* engine, size_t bytes){
+    engine_header* header = engine->header;
+    __u64 used = __atomic_load_n(&header->used, __ATOMIC_RELAXED);
+
+    bytes = AlignUp(bytes, ENGINE_ALIGN);
+    do{
+        if(used + bytes > header->bytes){
+            errno = ENOMEM;
+            return 0;
+        }
+    }while(!__atomic_compare_exchange_n(&header->used, &used, used + bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return used;
+}
+
+/*
+ * Taking an object from a pool, or from the mapping when the pool is empty. Returns 0 on error.
+ * A popped head may be reused under us, and then its link is garbage, but the change count fails the swap.
+ */
+static __u64 PoolAlloc(msg_engine* engine, unsigned int pool){
+    engine_pool* Pool = &engine->header->pools[pool];
+    __u64 head = __atomic_load_n(&Pool->head, __ATOMIC_ACQUIRE);
+    __u64 offset, next;
+
+    while((offset = head & OFFSET_MASK) != 0){
+        next = __atomic_load_n((__u64*)EngineAt(engine, offset), __ATOMIC_RELAXED);
+        if(__atomic_compare_exchange_n(&Pool->head, &head, (next & OFFSET_MASK) | ((head + TAG_ONE) & ~OFFSET_MASK),
+                                       1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)){
+            return offset;
+        }
+    }
+    return AllocBytes(engine, Pool->object_bytes);
+}
+
+static void PoolFree(msg_engine* engine, unsigned int pool, __u64 offset){
+    engine_pool* Pool = &engine->header->pools[pool];
+    __u64 head = __atomic_load_n(&Pool->head, __ATOMIC_RELAXED);
+
+    do{
+        __atomic_store_n((__u64*)EngineAt(engine, offset), head & OFFSET_MASK, __ATOMIC_RELAXED);
+    }while(!__atomic_compare_exchange_n(&Pool->head, &head, offset | ((head + TAG_ONE) & ~OFFSET_MASK),
+                                        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static unsigned int PayloadPool(size_t length){
+    unsigned int shift = PAYLOAD_MIN_SHIFT;
+    while((1UL << shift) < length){
+        shift++;
+    }
+    return MESSAGE_CLASSES + 1 + shift - PAYLOAD_MIN_SHIFT;
+}
+
+/*
+ * Allocating a message for length bytes from the pool of its size class, as NewSlotMessage() does.
+ * The caller fills it. Returns NULL on error.
+ */
+static engine_message* NewEngineMessage(msg_engine* engine, size_t length){
+    engine_message* NewMessage = NULL;
+    unsigned int size_class = 0;
+    __u64 offset;
+
+    while(size_class < MESSAGE_CLASSES && length > ClassBytes[size_class]){
+        size_class++;
+    }
+    offset = PoolAlloc(engine, size_class);
+    if(offset == 0){
+        return NULL;
+    }
+
+    //Readers holding a stale offset may look at refs, which stays 0 until the message is ours.
+    NewMessage = (engine_message*)EngineAt(engine, offset);
+    NewMessage->msg = offset + offsetof(engine_message, inline_msg);
+    if(size_class == MESSAGE_CLASSES){
+        NewMessage->msg = PoolAlloc(engine, PayloadPool(length));
+        if(NewMessage->msg == 0){
+            PoolFree(engine, size_class, offset);
+            return NULL;
+        }
+    }
+    NewMessage->length = length;
+    NewMessage->size_class = size_class;
+    __atomic_store_n(&NewMessage->refs, 1, __ATOMIC_RELAXED);
+    return NewMessage;
+}
+
+/*
+ * Dropping a reference to a message. The last one returns it to its pool at once, where it stays a message.
+ */
+static void PutEngineMessage(msg_engine* engine, engine_message* OldMessage){
+    if(__atomic_sub_fetch(&OldMessage->refs, 1, __ATOMIC_ACQ_REL) != 0){
+        return;
+    }
+    if(OldMessage->size_class == MESSAGE_CLASSES){
+        PoolFree(engine, PayloadPool(OldMessage->length), OldMessage->msg);
+    }
+    PoolFree(engine, OldMessage->size_class, EngineOffset(engine, OldMessage));
+}
+
+static int RefIncNotZero(__u32* refs){
+    __u32 count = __atomic_load_n(refs, __ATOMIC_RELAXED);
+    do{
+        if(count == 0){
+            return 0;
+        }
+    }while(!__atomic_compare_exchange_n(refs, &count, count + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+ * Taking a reference to the last message of a channel. Returns NULL when there is none.
+ * A message whose last reference is gone was already replaced, so we look again. A message we got a
+ * reference to may have been freed and reused meanwhile, so it counts only if it is still the last one.
+ */
+static engine_message* GetLastMessage(msg_engine* engine, engine_node* FoundedNode){
+    engine_message* LastMessage = NULL;
+    __u64 last;
+
+    for(;;){
+        last = __atomic_load_n(&FoundedNode->last, __ATOMIC_ACQUIRE);
+        if(last == 0){
+            return NULL;
+        }
+        LastMessage = (engine_message*)EngineAt(engine, last);
+        if(!RefIncNotZero(&LastMessage->refs)){
+            continue;
+        }
+        if(__atomic_load_n(&FoundedNode->last, __ATOMIC_ACQUIRE) == last){
+            return LastMessage;
+        }
+        PutEngineMessage(engine, LastMessage);
+    }
+}
+
+/*
+ * Finding a channel in the index of its slot without locking. Entries are only added, and every one is
+ * published after the node it points to was filled.
+ */
+static engine_node* LookupNode(msg_engine* engine, engine_slot* WorkSlot, unsigned long channel){
+    __u64 root = __atomic_load_n(&WorkSlot->root, __ATOMIC_ACQUIRE);
+    unsigned int shift = (root & INDEX_MASK) * INDEX_SHIFT;
+    __u64 entry = root & ~(__u64)INDEX_MASK;
+
+    if(entry == 0 || (channel >> shift) >> INDEX_SHIFT != 0){
+        return NULL; //Beyond the height of the tree.
+    }
+    for(;;){
+        engine_index* Index = (engine_index*)EngineAt(engine, entry);
+        entry = __atomic_load_n(&Index->entries[(channel >> shift) & INDEX_MASK], __ATOMIC_ACQUIRE);
+        if(entry == 0){
+            return NULL;
+        }
+        if(shift == 0){
+            return (engine_node*)EngineAt(engine, entry);
+        }
+        shift -= INDEX_SHIFT;
+    }
+}
+
+/*
+ * Adding the index nodes and the channel node of a channel. Called with the slot lock held.
+ * A taller tree gets a new root whose first entry is the old root, so lookups on the old one still work.
+ * Returns NULL when the mapping is full. What was added stays, empty.
+ */
+static engine_node* InsertNode(msg_engine* engine, engine_slot* WorkSlot, unsigned long channel){
+    __u64 root = __atomic_load_n(&WorkSlot->root, __ATOMIC_RELAXED);
+    unsigned int height = root & INDEX_MASK;
+    engine_node* NewNode = NULL;
+    __u64 entry, child, *slot_entry;
+    unsigned int shift;
+
+    while(root == 0 || (channel >> (height * INDEX_SHIFT)) >> INDEX_SHIFT != 0){
+        entry = AllocBytes(engine, sizeof(engine_index));
+        if(entry == 0){
+            return NULL;
+        }
+        if(root != 0){
+            ((engine_index*)EngineAt(engine, entry))->entries[0] = root & ~(__u64)INDEX_MASK;
+            height++;
+        }
+        root = entry | height;
+        __atomic_store_n(&WorkSlot->root, root, __ATOMIC_RELEASE);
+    }
+
+    entry = root & ~(__u64)INDEX_MASK;
+    for(shift = height * INDEX_SHIFT; shift > 0; shift -= INDEX_SHIFT){
+        slot_entry = &((engine_index*)EngineAt(engine, entry))->entries[(channel >> shift) & INDEX_MASK];
+        child = __atomic_load_n(slot_entry, __ATOMIC_RELAXED);
+        if(child == 0){
+            child = AllocBytes(engine, sizeof(engine_index));
+            if(child == 0){
+                return NULL;
+            }
+            __atomic_store_n(slot_entry, child, __ATOMIC_RELEASE);
+        }
+        entry = child;
+    }
+
+    child = AllocBytes(engine, sizeof(engine_node));
+    if(child == 0){
+        return NULL;
+    }
+    NewNode = (engine_node*)EngineAt(engine, child);
+    NewNode->channel = channel;
+    NewNode->refs = 1; //Of the index.
+    __atomic_store_n(&((engine_index*)EngineAt(engine, entry))->entries[channel & INDEX_MASK], child, __ATOMIC_RELEASE);
+    return NewNode;
+}
+
+/*
+ * Adding a channel to its slot, as AddNode() does. The channel is counted before it is added, so
+ * concurrent creators can't pass CHANNEL_NUMBER, and uncounted again when another writer added it first
+ * or the mapping is full.
+ */
+static engine_node* AddNode(engine_file* file, engine_slot* WorkSlot){
+    engine_node* NewNode = NULL;
+
+    if(__atomic_add_fetch(&WorkSlot->count, 1, __ATOMIC_RELAXED) > CHANNEL_NUMBER){
+        __atomic_sub_fetch(&WorkSlot->count, 1, __ATOMIC_RELAXED);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    EngineLock(&WorkSlot->lock, file->pid);
+    NewNode = LookupNode(file->engine, WorkSlot, file->channel);
+    if(NewNode != NULL){
+        __atomic_sub_fetch(&WorkSlot->count, 1, __ATOMIC_RELAXED); //Lost the race.
+    }else{
+        NewNode = InsertNode(file->engine, WorkSlot, file->channel);
+        if(NewNode == NULL){
+            __atomic_sub_fetch(&WorkSlot->count, 1, __ATOMIC_RELAXED);
+        }
+    }
+    EngineUnlock(&WorkSlot->lock);
+    return NewNode;
+}
+
+/*
+ * Taking a reference to the node of the file's channel, adding it when create is set. Returns NULL if
+ * there is none.
+ */
+static engine_node* GetFileNode(engine_file* file, int create){
+    engine_slot* WorkSlot = &file->engine->slots[file->minor];
+    engine_node* WorkNode = LookupNode(file->engine, WorkSlot, file->channel);
+
+    if(WorkNode == NULL && create){
+        WorkNode = AddNode(file, WorkSlot);
+    }
+    if(WorkNode != NULL){
+        __atomic_add_fetch(&WorkNode->refs, 1, __ATOMIC_ACQUIRE);
+    }
+    return WorkNode;
+}
+
+static void PutNode(engine_node* WorkNode){
+    __atomic_sub_fetch(&WorkNode->refs, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pointing the process side of an engine into its mapping.
+ */
+static msg_engine* EngineFromMapping(void* mapping){
+    msg_engine* engine = malloc(sizeof(msg_engine));
+    if(engine == NULL){
+        return NULL;
+    }
+
+    engine->base = (char*)mapping;
+    engine->header = (engine_header*)mapping;
+    engine->slots = (engine_slot*)(engine->base + AlignUp(sizeof(engine_header), ENGINE_ALIGN));
+    return engine;
+}
+
+msg_engine* EngineCreate(const char* name, unsigned int slots, size_t bytes, unsigned int max_msg_bytes){
+    size_t arena, total;
+    void* mapping;
+    unsigned int i;
+    int file_desc = -1;
+
+    if(slots == 0 || max_msg_bytes == 0 || max_msg_bytes > MAX_MSG_LIMIT){
+        errno = EINVAL;
+        return NULL;
+    }
+    arena = AlignUp(sizeof(engine_header), ENGINE_ALIGN) + (size_t)slots * sizeof(engine_slot);
+    total = AlignUp(arena + bytes, 4096);
+    if(total < arena || total > OFFSET_MASK){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(name != NULL){
+        file_desc = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if(file_desc < 0){
+            return NULL;
+        }
+        if(ftruncate(file_desc, total) < 0){
+            close(file_desc);
+            shm_unlink(name);
+            return NULL;
+        }
+        mapping = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, file_desc, 0);
+        close(file_desc);
+    }else{
+        mapping = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    }
+    if(mapping == MAP_FAILED){
+        if(name != NULL){
+            shm_unlink(name);
+        }
+        return NULL;
+    }
+
+    //The mapping starts zeroed, so every slot is empty and every pool has no free objects.
+    engine_header* header = (engine_header*)mapping;
+    header->bytes = total;
+    header->used = arena;
+    header->slots = slots;
+    header->max_msg_bytes = max_msg_bytes;
+    for(i = 0; i < MESSAGE_CLASSES; i++){
+        header->pools[i].object_bytes = AlignUp(sizeof(engine_message) + ClassBytes[i], ENGINE_ALIGN);
+    }
+    header->pools[MESSAGE_CLASSES].object_bytes = AlignUp(sizeof(engine_message), ENGINE_ALIGN);
+    for(i = 0; i < PAYLOAD_POOLS; i++){
+        header->pools[MESSAGE_CLASSES + 1 + i].object_bytes = 1U << (PAYLOAD_MIN_SHIFT + i);
+    }
+    __atomic_store_n(&header->magic, ENGINE_MAGIC, __ATOMIC_RELEASE); //Attach refuses the engine until it is ready.
+    return EngineFromMapping(mapping);
+}
+
+msg_engine* EngineAttach(const char* name){
+    engine_header header;
+    void* mapping;
+    int file_desc;
+
+    file_desc = shm_open(name, O_RDWR, 0);
+    if(file_desc < 0){
+        return NULL;
+    }
+    if(pread(file_desc, &header, sizeof(header), 0) != sizeof(header) ||
+       header.magic != ENGINE_MAGIC){
+        close(file_desc);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    mapping = mmap(NULL, header.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file_desc, 0);
+    close(file_desc);
+    return mapping == MAP_FAILED ? NULL : EngineFromMapping(mapping);
+}
+
+void EngineDetach(msg_engine* engine){
+    munmap(engine->base, engine->header->bytes);
+    free(engine);
+}
+
+int EngineUnlink(const char* name){
+    return shm_unlink(name);
+}
+
+int EngineOpen(msg_engine* engine, unsigned int minor, engine_file* file){
+    if(engine == NULL || file == NULL || minor >= engine->header->slots){
+        errno = ENODEV;
+        return -1;
+    }
+    file->engine = engine;
+    file->minor = minor;
+    file->channel = 0;
+    file->pid = getpid();
+    return 0;
+}
+
+int EngineIoctl(engine_file* file, unsigned int command, unsigned long param){
+    if(command != MSG_SLOT_CHANNEL || param == 0){
+        errno = EINVAL;
+        return -1;
+    }
+    file->channel = param;
+    return 0;
+}
+
+/*
+ * Filling a new message and publishing it on the channel, as WriteChannel() does for last message channels.
+ * The message replaces the last one with one pointer swap, so readers see either the old or the new message.
+ */
+ssize_t EngineWrite(engine_file* file, const char* buffer, size_t length){
+    msg_engine* engine = file->engine;
+    engine_message* NewMessage = NULL;
+    engine_node* WorkNode = NULL;
+    __u64 old;
+
+    if(file->channel == 0){
+        errno = EINVAL;
+        return -1;
+    }
+    if(length == 0 || length > engine->header->max_msg_bytes){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    NewMessage = NewEngineMessage(engine, length);
+    if(NewMessage == NULL){
+        return -1;
+    }
+    memcpy(EngineAt(engine, NewMessage->msg), buffer, length);
+
+    WorkNode = GetFileNode(file, 1);
+    if(WorkNode == NULL){
+        PutEngineMessage(engine, NewMessage);
+        return -1;
+    }
+
+    EngineLock(&WorkNode->lock, file->pid);
+    old = __atomic_load_n(&WorkNode->last, __ATOMIC_RELAXED);
+    __atomic_store_n(&WorkNode->last, EngineOffset(engine, NewMessage), __ATOMIC_RELEASE);
+    EngineUnlock(&WorkNode->lock);
+
+    if(old != 0){
+        PutEngineMessage(engine, (engine_message*)EngineAt(engine, old)); //Readers may still be copying it.
+    }
+    PutNode(WorkNode);
+    return length;
+}
+
+ssize_t EngineRead(engine_file* file, char* buffer, size_t length){
+    msg_engine* engine = file->engine;
+    engine_message* LastMessage = NULL;
+    engine_node* FoundedNode = NULL;
+    ssize_t ret_val;
+
+    if(file->channel == 0){
+        errno = EINVAL;
+        return -1;
+    }
+    FoundedNode = GetFileNode(file, 0);
+    if(FoundedNode == NULL){
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    LastMessage = GetLastMessage(engine, FoundedNode);
+    if(LastMessage == NULL){
+        errno = EWOULDBLOCK;
+        ret_val = -1;
+    }else if(LastMessage->length > length){
+        errno = ENOSPC;
+        ret_val = -1;
+    }else{
+        memcpy(buffer, EngineAt(engine, LastMessage->msg), LastMessage->length);
+        ret_val = LastMessage->length;
+    }
+
+    if(LastMessage != NULL){
+        PutEngineMessage(engine, LastMessage);
+    }
+    PutNode(FoundedNode);
+    return ret_val;
+}
@@ -0,0 +1,78 @@
+#ifndef MESSAGE_ENGINE
+#define MESSAGE_ENGINE
+
+#include "message_slot.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Userspace model of the message_slot module, kept in shared memory so several processes can use it at once,
+ * without the module or root. It follows the driver's data structures, so measuring it says something about them:
+ *
+ * - Every slot has its own channel index, a radix tree with 64 entries per node that grows in height as
+ *   the driver's xarray does. Lookups don't lock, and insertions take the slot lock.
+ * - Every channel node has a lock that serializes its writers. A write fills a new message and replaces the
+ *   last message with one pointer swap, and readers take a reference to the last message without locking.
+ * - Messages come from the driver's size classes (MESSAGE_CLASS_BYTES) with the payload inline, and bigger
+ *   ones keep a separate payload, up to the max_msg_bytes of the engine.
+ *
+ * The driver frees a message a grace period after its last reference. RCU doesn't exist across processes,
+ * so here freed messages go back to the free list of their class and stay messages, as with
+ * SLAB_TYPESAFE_BY_RCU: a reader that got a reference to a reused message sees it is no longer the
+ * channel's last message and looks again.
+ *
+ * A read returns the last message without consuming it, fails with EWOULDBLOCK when the channel has
+ * no message and with ENOSPC when the buffer is too small. Writes of 0 or more than max_msg_bytes bytes
+ * fail with EMSGSIZE. Queued channels, shared rings, quotas and deletion are kernel only, so channels
+ * are never freed.
+ *
+ * Locks hold the pid of their owner. A process killed while holding one, for example by Ctrl-C, leaves
+ * the structures consistent, since everything is published with a single store, and the lock is taken
+ * over once its owner is gone.
+ */
+
+struct engine_header;
+struct engine_slot;
+struct engine_node;
+
+/*
+ * Mapping of an engine in this process.
+ */
+typedef struct msg_engine{
+    struct engine_header* header;
+    struct engine_slot* slots;
+    char* base;
+} msg_engine;
+
+/*
+ * Open "file" of a slot, as returned by open() on the device.
+ */
+typedef struct engine_file{
+    msg_engine* engine;
+    unsigned int minor;
+    unsigned long channel;      //0 until MSG_SLOT_CHANNEL.
+    pid_t pid;                  //Owner written into the locks this file takes.
+} engine_file;
+
+/*
+ * Creating an engine with slots slots, taking up to bytes bytes of shared memory for channels and
+ * messages, which accepts messages up to max_msg_bytes (at most MAX_MSG_LIMIT).
+ * With a name the engine is a POSIX shared memory object other processes can attach to.
+ * Without one it is an anonymous shared mapping, inherited by children after fork().
+ * Memory is only used once touched. Returns NULL and sets errno on error.
+ */
+msg_engine* EngineCreate(const char* name, unsigned int slots, size_t bytes, unsigned int max_msg_bytes);
+msg_engine* EngineAttach(const char* name);
+void EngineDetach(msg_engine* engine);
+int EngineUnlink(const char* name);
+
+/*
+ * Device API. Like the system calls, they return -1 and set errno on error.
+ * A file belongs to the process that opened it.
+ */
+int EngineOpen(msg_engine* engine, unsigned int minor, engine_file* file);
+int EngineIoctl(engine_file* file, unsigned int command, unsigned long param);
+ssize_t EngineWrite(engine_file* file, const char* buffer, size_t length);
+ssize_t EngineRead(engine_file* file, char* buffer, size_t length);
+
+#endif
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include "message_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/*
+ * Multi process benchmark of the message slot engine. Every process writes and reads random channels,
+ * either from its own range or from one range all processes share. Messages are one repeated byte, so
+ * torn reads are counted. With -d the same workload runs against the module through a device file,
+ * so the userspace engine and the driver can be compared. Messages longer than MAX_MSG_BYTES need the
+ * module loaded with a big enough max_msg_bytes, and the engine is created with one.
+ *
+ * Build: make engine_bench
+ * Usage: ./engine_bench [-p processes] [-c channels] [-s seconds] [-r read percent] [-b bytes] [-S] [-d device]
+ */
+
+#define DEFAULT_PROCESSES 4
+#define DEFAULT_CHANNELS 1024
+#define DEFAULT_SECONDS 3
+#define DEFAULT_READ_PERCENT 50
+#define DEFAULT_MSG_BYTES 64
+#define CLOCK_CHECK_OPS 1024
+
+typedef struct bench_result{
+    long reads;
+    long writes;
+    long empty;
+    long torn;
+    double seconds;     //Measured by the process, from its start to the end of its loop.
+} __attribute__((aligned(64))) bench_result;
+
+/*
+ * Channel handle of one process, on the engine or on the device.
+ */
+typedef struct bench_file{
+    engine_file engine;
+    int file_desc;
+    unsigned long channel;
+} bench_file;
+
+static int Processes = DEFAULT_PROCESSES;
+static int Channels = DEFAULT_CHANNELS;
+static int Seconds = DEFAULT_SECONDS;
+static int ReadPercent = DEFAULT_READ_PERCENT;
+static int MsgBytes = DEFAULT_MSG_BYTES;
+static int Shared = 0;
+static const char* DevicePath = NULL;
+
+static double NowSeconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static unsigned long NextRandom(unsigned long* state){
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static int MessageIsWhole(const char* Message, int length){
+    int i;
+    for(i = 1; i < length; i++){
+        if(Message[i] != Message[0]){
+            return 0;
+        }
+    }
+    return length == MsgBytes;
+}
+
+/*
+ * Shared memory for the engine: every channel keeps one message, and every process may hold a few more
+ * while it writes and reads. Untouched memory costs nothing, so this errs on the large side.
+ */
+static size_t EngineBytes(void){
+    size_t message = 256, channels = (size_t)Channels * (Shared ? 1 : Processes);
+    while(message < (size_t)MsgBytes + 256){
+        message <<= 1;
+    }
+    return (channels + 4 * Processes) * (message + 256) + (16 << 20);
+}
+
+static int SetChannel(bench_file* file, unsigned long channel){
+    if(file->channel == channel){
+        return 0;
+    }
+    file->channel = channel;
+    if(DevicePath != NULL){
+        return ioctl(file->file_desc, MSG_SLOT_CHANNEL, channel);
+    }
+    return EngineIoctl(&file->engine, MSG_SLOT_CHANNEL, channel);
+}
+
+static ssize_t BenchWrite(bench_file* file, const char* Message, size_t length){
+    return DevicePath != NULL ? write(file->file_desc, Message, length) : EngineWrite(&file->engine, Message, length);
+}
+
+static ssize_t BenchRead(bench_file* file, char* Message, size_t length){
+    return DevicePath != NULL ? read(file->file_desc, Message, length) : EngineRead(&file->engine, Message, length);
+}
+
+static void BenchLoop(msg_engine* engine, int index, bench_result* result){
+    bench_file file = {.file_desc = -1, .channel = 0};
+    char* Message = malloc(MsgBytes);
+    char* Read = malloc(MsgBytes);
+    unsigned long random = 0x9e3779b97f4a7c15UL * (index + 1);
+    unsigned long base = Shared ? 1 : (unsigned long)index * Channels + 1;
+    double start = NowSeconds();
+    double deadline = start + Seconds;
+    long ops = 0;
+    ssize_t ret_val;
+
+    if(Message == NULL || Read == NULL){
+        perror("Error in allocating messages");
+        exit(1);
+    }
+    if(DevicePath != NULL){
+        file.file_desc = open(DevicePath, O_RDWR);
+        if(file.file_desc < 0){
+            perror("Error in opening file");
+            exit(1);
+        }
+    }else if(EngineOpen(engine, 0, &file.engine) < 0){
+        perror("Error in opening engine");
+        exit(1);
+    }
+
+    for(;;){
+        if(++ops % CLOCK_CHECK_OPS == 0 && NowSeconds() >= deadline){
+            break;
+        }
+        if(SetChannel(&file, base + NextRandom(&random) % Channels) < 0){
+            perror("Error in setting channel");
+            exit(1);
+        }
+
+        if((int)(NextRandom(&random) % 100) < ReadPercent){
+            ret_val = BenchRead(&file, Read, MsgBytes);
+            if(ret_val < 0 && errno != EWOULDBLOCK){
+                perror("Error in reading massage");
+                exit(1);
+            }
+            if(ret_val < 0){
+                result->empty++;
+            }else if(!MessageIsWhole(Read, ret_val)){
+                result->torn++;
+            }
+            result->reads++;
+        }else{
+            memset(Message, 'a' + ops % 26, MsgBytes);
+            if(BenchWrite(&file, Message, MsgBytes) != MsgBytes){
+                perror("Error in writing message");
+                exit(1);
+            }
+            result->writes++;
+        }
+    }
+
+    result->seconds = NowSeconds() - start;
+    if(file.file_desc >= 0){
+        close(file.file_desc);
+    }
+    free(Read);
+    free(Message);
+}
+
+int main(int argc, char* argv[]){
+    msg_engine* engine = NULL;
+    bench_result* results;
+    long empty = 0, torn = 0;
+    double read_rate = 0, write_rate = 0;
+    int opt, i, status;
+
+    while((opt = getopt(argc, argv, "p:c:s:r:b:Sd:")) != -1){
+        switch(opt){
+            case 'p':
+                Processes = atoi(optarg);
+                break;
+            case 'c':
+                Channels = atoi(optarg);
+                break;
+            case 's':
+                Seconds = atoi(optarg);
+                break;
+            case 'r':
+                ReadPercent = atoi(optarg);
+                break;
+            case 'b':
+                MsgBytes = atoi(optarg);
+                break;
+            case 'S':
+                Shared = 1;
+                break;
+            case 'd':
+                DevicePath = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p processes] [-c channels] [-s seconds] [-r read percent] [-b bytes] [-S] [-d device]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if(Processes <= 0 || Channels <= 0 || Seconds <= 0 || ReadPercent < 0 || ReadPercent > 100 ||
+       MsgBytes <= 0 || MsgBytes > MAX_MSG_LIMIT){
+        fprintf(stderr, "Error in benchmark arguments.\n");
+        exit(1);
+    }
+
+    if(DevicePath == NULL){
+        engine = EngineCreate(NULL, 1, EngineBytes(), MsgBytes > MAX_MSG_BYTES ? MsgBytes : MAX_MSG_BYTES);
+        if(engine == NULL){
+            perror("Error in creating engine");
+            exit(1);
+        }
+    }
+
+    results = mmap(NULL, Processes * sizeof(bench_result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(results == MAP_FAILED){
+        perror("Error in mapping results");
+        exit(1);
+    }
+    memset(results, 0, Processes * sizeof(bench_result));
+
+    for(i = 0; i < Processes; i++){
+        pid_t pid = fork();
+        if(pid < 0){
+            perror("Failed to conduct fork() function.");
+            exit(1);
+        }else if(pid == 0){
+            BenchLoop(engine, i, &results[i]);
+            exit(0);
+        }
+    }
+
+    for(i = 0; i < Processes; i++){
+        if(wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            fprintf(stderr, "Benchmark process failed.\n");
+            exit(1);
+        }
+    }
+
+    for(i = 0; i < Processes; i++){
+        empty += results[i].empty;
+        torn += results[i].torn;
+        //Processes start at different times and stop a little late, so each one is rated by its own time.
+        read_rate += results[i].reads / results[i].seconds;
+        write_rate += results[i].writes / results[i].seconds;
+    }
+
+    printf("%s, %d processes, %d %s channels, %d%% reads, %d byte messages\n", DevicePath ? DevicePath : "engine",
+           Processes, Channels, Shared ? "shared" : "private", ReadPercent, MsgBytes);
+    printf("  %.0f ops/sec (%.0f reads/sec, %.0f writes/sec), %ld empty reads, %ld torn reads\n",
+           read_rate + write_rate, read_rate, write_rate, empty, torn);
+
+    if(engine != NULL){
+        EngineDetach(engine);
+    }
+    return torn != 0;
+}
@@ -1,25 +1,392 @@
+#define _GNU_SOURCE
 #include "message_slot.h"
+#include "message_ring.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+/*
+ * Usage: message_reader <device> <channel> [ring]
+ *        message_reader <device> <channel> --stream [-n channels] [-q depth] [-c count] [-r | -w]
+ * With "ring" the message is taken from the channel's shared ring, waiting for one if it is empty.
+ *
+ * With --stream messages of channels channel..channel+channels-1 are printed one per line as they arrive,
+ * until count messages were read or until SIGINT. The channels are switched to queued mode with the given
+ * depth, so every message is read once. -r takes the messages from the shared ring of one channel.
+ * -w uses one fd with a channel watch instead of one fd per channel.
+ * Messages/sec is reported on stderr at the end.
+ * Buffers are sized for the module's max_msg_bytes, so messages longer than MAX_MSG_BYTES are read whole.
+ */
+
+#define DEFAULT_STREAM_DEPTH 256
+#define STREAM_OUTPUT_BYTES 65536
+#define STREAM_BATCH_BYTES (4 << 20)
+
+static int Channels = 1;
+static unsigned long Depth = DEFAULT_STREAM_DEPTH;
+static long Count = 0;
+static int UseRing = 0;
+static int UseWatch = 0;
+static int MaxMessage = MAX_MSG_BYTES;
+static volatile sig_atomic_t Running = 1;
+
+static void StopStream(int signal){
+    (void)signal;
+    Running = 0;
+}
+
+static double NowSeconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Biggest message the loaded module takes, read from its max_msg_bytes parameter.
+ * Never below MAX_MSG_BYTES, so a buffer of this size also holds a shared ring entry.
+ */
+static int MaxMessageBytes(void){
+    FILE* param = fopen(MAX_MSG_PARAM, "r");
+    int bytes = 0;
+
+    if(param != NULL){
+        if(fscanf(param, "%d", &bytes) != 1){
+            bytes = 0;
+        }
+        fclose(param);
+    }
+    return bytes > MAX_MSG_BYTES && bytes <= MAX_MSG_LIMIT ? bytes : MAX_MSG_BYTES;
+}
+
+static void PrintMessage(const char* Message, int length){
+    if(fwrite(Message, 1, length, stdout) != (size_t)length || putchar('\n') == EOF){
+        perror("Error in writing to console");
+        exit(1);
+    }
+}
+
+static long StreamRing(int file_desc){
+    struct msg_slot_ring* Ring = RingMap(file_desc, RING_DEFAULT_ENTRIES);
+    char Message[MAX_MSG_BYTES];
+    long received = 0;
+    int length;
+
+    if(Ring == NULL){
+        perror("Error in mapping ring");
+        exit(1);
+    }
+    while(Running && (Count == 0 || received < Count)){
+        if(!RingHasMessage(Ring)){
+            fflush(stdout); //Nothing more is coming for now, so whatever is buffered goes out.
+            if(RingWait(file_desc, &Ring->reader_waiting, RING_READABLE, RingHasMessage, Ring) < 0){
+                perror("Error in reading massage");
+                exit(1);
+            }
+            continue; //Woken by a message or by a signal.
+        }
+        length = RingPop(file_desc, Ring, Message);
+        if(length < 0){
+            perror("Error in reading massage");
+            exit(1);
+        }
+        PrintMessage(Message, length);
+        received++;
+    }
+    return received;
+}
+
+/*
+ * Every channel has its own fd, so poll() tells which ones have messages. Readable fds are drained
+ * without blocking, and the output is flushed only before poll() would sleep.
+ */
+static long StreamChannels(char* FilePath, unsigned long Channel){
+    struct pollfd* fds = calloc(Channels, sizeof(struct pollfd));
+    char* Message = malloc(MaxMessage);
+    long received = 0;
+    int i, ready, length;
+
+    if(fds == NULL || Message == NULL){
+        perror("Error in allocating channels");
+        exit(1);
+    }
+    for(i = 0; i < Channels; i++){
+        fds[i].fd = open(FilePath, O_RDONLY | O_NONBLOCK);
+        if(fds[i].fd < 0){
+            perror("Error in opening file");
+            exit(1);
+        }
+        if(ioctl(fds[i].fd, MSG_SLOT_CHANNEL, Channel + i) < 0 || ioctl(fds[i].fd, MSG_SLOT_QUEUE_DEPTH, Depth) < 0){
+            perror("Error in opening device");
+            exit(1);
+        }
+        fds[i].events = POLLIN;
+    }
+
+    while(Running && (Count == 0 || received < Count)){
+        ready = poll(fds, Channels, 0);
+        if(ready == 0){
+            fflush(stdout);
+            ready = poll(fds, Channels, -1);
+        }
+        if(ready < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("Error in polling channels");
+            exit(1);
+        }
+
+        for(i = 0; i < Channels; i++){
+            if(fds[i].revents & (POLLERR | POLLNVAL)){
+                fprintf(stderr, "Error in polling channel %lu.\n", Channel + i);
+                exit(1);
+            }
+            while((fds[i].revents & POLLIN) && (Count == 0 || received < Count)){
+                length = read(fds[i].fd, Message, MaxMessage);
+                if(length < 0 && errno == EWOULDBLOCK){
+                    break;
+                }
+                if(length < 0){
+                    perror("Error in reading massage");
+                    exit(1);
+                }
+                PrintMessage(Message, length);
+                received++;
+            }
+        }
+    }
+
+    for(i = 0; i < Channels; i++){
+        close(fds[i].fd);
+    }
+    free(Message);
+    free(fds);
+    return received;
+}
+
+/*
+ * Reading every message of the given batch entries, a batch at a time, until all their channels are empty.
+ */
+static long DrainChannels(int file_desc, struct msg_slot_batch_entry* entries, int count, long received){
+    struct msg_slot_batch batch;
+    int done, kept, i;
+
+    while(count > 0 && (Count == 0 || received < Count)){
+        for(done = 0; done < count; done += batch.count){
+            batch.entries = (__u64)(unsigned long)(entries + done);
+            batch.count = count - done < MAX_BATCH_ENTRIES ? count - done : MAX_BATCH_ENTRIES;
+            if(ioctl(file_desc, MSG_SLOT_READ_BATCH, &batch) < 0){
+                perror("Error in reading batch");
+                exit(1);
+            }
+        }
+
+        for(i = 0, kept = 0; i < count; i++){
+            if(entries[i].result == -EWOULDBLOCK){
+                continue;
+            }
+            if(entries[i].result < 0){
+                errno = -entries[i].result;
+                perror("Error in reading massage");
+                exit(1);
+            }
+            if(Count == 0 || received < Count){
+                PrintMessage((char*)(unsigned long)entries[i].buffer, entries[i].result);
+                received++;
+            }
+            entries[kept++] = entries[i]; //Its channel may hold more messages.
+        }
+        count = kept;
+    }
+    return received;
+}
+
+/*
+ * One fd for all channels. The module marks written channels in a dirty bitmap and signals an eventfd,
+ * so only the channels that have messages are read, in batches. The batches share message buffers,
+ * so at most STREAM_BATCH_BYTES of them are allocated whatever max_msg_bytes is.
+ */
+static long StreamWatch(char* FilePath, unsigned long Channel){
+    int words = (Channels + 63) / 64;
+    struct msg_slot_batch_entry* entries = calloc(Channels, sizeof(*entries));
+    int window = STREAM_BATCH_BYTES / MaxMessage > 0 ? STREAM_BATCH_BYTES / MaxMessage : 1;
+    char* Messages;
+    __u64* channels = calloc(Channels, sizeof(__u64));
+    __u64* bitmap = calloc(words, sizeof(__u64));
+    struct msg_slot_watch watch = {.channels = (__u64)(unsigned long)channels, .count = Channels};
+    struct msg_slot_dirty dirty = {.bitmap = (__u64)(unsigned long)bitmap, .words = words};
+    long received = 0;
+    int file_desc, count, slice, i, j;
+    __u64 signals;
+
+    if(window > Channels){
+        window = Channels;
+    }
+    Messages = malloc((size_t)window * MaxMessage);
+    if(entries == NULL || Messages == NULL || channels == NULL || bitmap == NULL){
+        perror("Error in allocating channels");
+        exit(1);
+    }
+    file_desc = open(FilePath, O_RDONLY);
+    watch.eventfd = eventfd(0, 0);
+    if(file_desc < 0 || watch.eventfd < 0){
+        perror("Error in opening file");
+        exit(1);
+    }
+    for(i = 0; i < Channels; i++){
+        channels[i] = Channel + i;
+        if(ioctl(file_desc, MSG_SLOT_CHANNEL, Channel + i) < 0 || ioctl(file_desc, MSG_SLOT_QUEUE_DEPTH, Depth) < 0){
+            perror("Error in opening device");
+            exit(1);
+        }
+    }
+    if(ioctl(file_desc, MSG_SLOT_WATCH, &watch) < 0){
+        perror("Error in watching channels");
+        exit(1);
+    }
+
+    for(i = 0; i < Channels; i++){ //Messages written before the watch were never marked.
+        bitmap[i / 64] |= 1ULL << (i % 64);
+    }
+    while(Running && (Count == 0 || received < Count)){
+        for(i = 0, count = 0; i < Channels; i++){
+            if(bitmap[i / 64] & (1ULL << (i % 64))){
+                entries[count].channel = Channel + i;
+                entries[count].length = MaxMessage;
+                count++;
+            }
+        }
+        for(i = 0; i < count && (Count == 0 || received < Count); i += window){
+            slice = count - i < window ? count - i : window;
+            for(j = 0; j < slice; j++){
+                entries[i + j].buffer = (__u64)(unsigned long)(Messages + (size_t)j * MaxMessage);
+            }
+            received = DrainChannels(file_desc, entries + i, slice, received);
+        }
+        if(Count != 0 && received >= Count){
+            break;
+        }
+
+        fflush(stdout);
+        if(read(watch.eventfd, &signals, sizeof(signals)) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("Error in waiting for channels");
+            exit(1);
+        }
+        memset(bitmap, 0, words * sizeof(__u64));
+        if(ioctl(file_desc, MSG_SLOT_FETCH_DIRTY, &dirty) < 0){
+            perror("Error in fetching channels");
+            exit(1);
+        }
+    }
+
+    close(watch.eventfd);
+    close(file_desc);
+    free(bitmap);
+    free(channels);
+    free(Messages);
+    free(entries);
+    return received;
+}
+
+static void ParseStreamOptions(int argc, char* argv[]){
+    int opt;
+
+    optind = 4;
+    while((opt = getopt(argc, argv, "n:q:c:rw")) != -1){
+        switch(opt){
+            case 'n':
+                Channels = atoi(optarg);
+                break;
+            case 'q':
+                Depth = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                Count = atol(optarg);
+                break;
+            case 'r':
+                UseRing = 1;
+                break;
+            case 'w':
+                UseWatch = 1;
+                break;
+            default:
+                exit(1);
+        }
+    }
+    if(optind != argc || Channels <= 0 || Depth == 0 || Depth > MAX_QUEUE_DEPTH || Count < 0 ||
+       (UseRing && (Channels != 1 || UseWatch)) || (UseWatch && Channels > MAX_WATCH_CHANNELS)){
+        fprintf(stderr, "Error in stream arguments.\n");
+        exit(1);
+    }
+}
 
 int main(int argc, char *argv[]){
     char* FilePath;
-    char Message[MAX_MSG_BYTES];
+    char* Message;
     unsigned long Channel;
     int file_desc, ret_val;
+    int Stream = argc >= 4 && strcmp(argv[3], "--stream") == 0;
+    struct sigaction Stop = {.sa_handler = StopStream};
+    double start;
+    long received;
 
-    if(argc != 3){
+    if(!Stream && argc != 3 && !(argc == 4 && strcmp(argv[3], "ring") == 0)){
         exit(1);
     }
 
     FilePath = argv[1];
     Channel = atoi(argv[2]);
+    MaxMessage = MaxMessageBytes();
 
-    file_desc = open(FilePath, O_RDONLY);
+    if(Stream){
+        ParseStreamOptions(argc, argv);
+        setvbuf(stdout, NULL, _IOFBF, STREAM_OUTPUT_BYTES);
+        sigaction(SIGINT, &Stop, NULL); //No SA_RESTART, so a waiting read or poll returns.
+        sigaction(SIGTERM, &Stop, NULL);
+
+        start = NowSeconds();
+        if(UseRing){
+            file_desc = open(FilePath, O_RDWR);
+            if(file_desc < 0){
+                perror("Error in opening file");
+                exit(1);
+            }
+            if(ioctl(file_desc, MSG_SLOT_CHANNEL, Channel) < 0){
+                perror("Error in opening device");
+                exit(1);
+            }
+            received = StreamRing(file_desc);
+            close(file_desc);
+        }else if(UseWatch){
+            received = StreamWatch(FilePath, Channel);
+        }else{
+            received = StreamChannels(FilePath, Channel);
+        }
+        start = NowSeconds() - start;
+
+        fflush(stdout);
+        fprintf(stderr, "%ld messages in %.3f seconds, %.0f messages/sec\n", received, start, start > 0 ? received / start : 0);
+        return 0;
+    }
+    UseRing = argc == 4;
+    Message = malloc(MaxMessage);
+    if(Message == NULL){
+        perror("Error in allocating message");
+        exit(1);
+    }
+
+    file_desc = open(FilePath, UseRing ? O_RDWR : O_RDONLY); //Consumer writes the ring tail.
     if(file_desc < 0){
         perror("Error in opening file");
         exit(1);
@@ -31,7 +398,16 @@ int main(int argc, char *argv[]){
         exit(1);
     }
 
-    ret_val = read(file_desc,Message,strlen(Message));
+    if(UseRing){
+        struct msg_slot_ring* Ring = RingMap(file_desc, RING_DEFAULT_ENTRIES);
+        if(Ring == NULL){
+            perror("Error in mapping ring");
+            exit(1);
+        }
+        ret_val = RingPop(file_desc, Ring, Message);
+    }else{
+        ret_val = read(file_desc,Message,MaxMessage); //The buffer size, whatever it holds.
+    }
     if(ret_val < 0){
         perror("Error in reading massage");
         exit(1);
@@ -50,5 +426,6 @@ int main(int argc, char *argv[]){
     }
 
     close(file_desc);
+    free(Message);
     return 0;
-}
\ No newline at end of file
+}
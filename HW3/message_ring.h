@@ -0,0 +1,122 @@
+#ifndef MESSAGE_RING
+#define MESSAGE_RING
+
+#include "message_slot.h"
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Userspace side of the shared channel ring. One producer and one consumer per channel.
+ * Messages are exchanged through head and tail only, and the kernel is entered just to sleep
+ * when the ring is full or empty and to wake a side that sleeps.
+ * Ring entries have a fixed MAX_MSG_BYTES payload, so longer messages, which the module takes when
+ * loaded with a bigger max_msg_bytes, have to go through write() and read().
+ */
+
+#define RING_DEFAULT_ENTRIES 1024
+
+/*
+ * Setting up the ring of the channel set on file_desc and mapping it. Returns NULL on error.
+ * The channel keeps its first ring, so both sides map the same one whatever size they ask for.
+ */
+static inline struct msg_slot_ring* RingMap(int file_desc, unsigned long entries){
+    void* ring;
+    int bytes = ioctl(file_desc, MSG_SLOT_RING_SETUP, entries);
+    if(bytes < 0){
+        return NULL;
+    }
+
+    ring = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file_desc, 0);
+    return ring == MAP_FAILED ? NULL : (struct msg_slot_ring*)ring;
+}
+
+/*
+ * Sleeping in the kernel until condition holds. The waiting flag is raised before the last check,
+ * so the other side either sees it and wakes us, or we see its update and don't sleep.
+ */
+static inline int RingWait(int file_desc, __u32* waiting, unsigned long condition, int (*ready)(struct msg_slot_ring*),
+                           struct msg_slot_ring* ring){
+    int ret_val = 0;
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if(!ready(ring)){
+        ret_val = ioctl(file_desc, MSG_SLOT_RING_WAIT, condition);
+        if(ret_val < 0 && errno == EINTR){
+            ret_val = 0;
+        }
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return ret_val;
+}
+
+static inline int RingHasRoom(struct msg_slot_ring* ring){
+    return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) < ring->size;
+}
+
+static inline int RingHasMessage(struct msg_slot_ring* ring){
+    return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+/*
+ * Producer side. Returns 0 on success.
+ */
+static inline int RingPush(int file_desc, struct msg_slot_ring* ring, const char* msg, __u32 length){
+    struct msg_slot_ring_entry* entry;
+    __u32 head;
+
+    if(length == 0 || length > MAX_MSG_BYTES){
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    while(!RingHasRoom(ring)){
+        if(RingWait(file_desc, &ring->writer_waiting, RING_WRITABLE, RingHasRoom, ring) < 0){
+            return -1;
+        }
+    }
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    entry = &ring->entries[head & (ring->size - 1)];
+    entry->length = length;
+    memcpy(entry->msg, msg, length);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&ring->reader_waiting, __ATOMIC_SEQ_CST)){
+        return ioctl(file_desc, MSG_SLOT_RING_WAKE) < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+/*
+ * Consumer side. msg must hold MAX_MSG_BYTES. Returns the message length, or -1 on error.
+ */
+static inline int RingPop(int file_desc, struct msg_slot_ring* ring, char* msg){
+    struct msg_slot_ring_entry* entry;
+    __u32 tail, length;
+
+    while(!RingHasMessage(ring)){
+        if(RingWait(file_desc, &ring->reader_waiting, RING_READABLE, RingHasMessage, ring) < 0){
+            return -1;
+        }
+    }
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    entry = &ring->entries[tail & (ring->size - 1)];
+    length = entry->length;
+    if(length > MAX_MSG_BYTES){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(msg, entry->msg, length);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&ring->writer_waiting, __ATOMIC_SEQ_CST)){
+        if(ioctl(file_desc, MSG_SLOT_RING_WAKE) < 0){
+            return -1;
+        }
+    }
+    return length;
+}
+
+#endif
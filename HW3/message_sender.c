@@ -1,13 +1,229 @@
+#define _GNU_SOURCE
 #include "message_slot.h"
+#include "message_ring.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * Usage: message_sender <device> <channel> <message> [ring]
+ *        message_sender <device> <channel> --stream [-l] [-n channels] [-b batch] [-r]
+ * With "ring" the message goes through the channel's shared ring instead of write().
+ *
+ * With --stream messages are read from stdin, one per line, or with -l as a native 32 bit length followed
+ * by that many bytes. They go over one fd, round robin on channels channel..channel+channels-1.
+ * -b sends up to batch messages per MSG_SLOT_WRITE_BATCH, -r sends through the shared ring of one channel.
+ * Messages/sec is reported on stderr at EOF.
+ * Messages may be as long as the module's max_msg_bytes, except through the ring, whose entries hold MAX_MSG_BYTES.
+ */
+
+#define DEFAULT_BATCH 1
+
+static unsigned long FirstChannel;
+static int Channels = 1;
+static int BatchSize = DEFAULT_BATCH;
+static int LengthDelimited = 0;
+static int UseRing = 0;
+static int MaxMessage = MAX_MSG_BYTES;
+
+static double NowSeconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Biggest message the loaded module takes, read from its max_msg_bytes parameter.
+ * Never below MAX_MSG_BYTES, so a buffer of this size also holds a shared ring entry.
+ */
+static int MaxMessageBytes(void){
+    FILE* param = fopen(MAX_MSG_PARAM, "r");
+    int bytes = 0;
+
+    if(param != NULL){
+        if(fscanf(param, "%d", &bytes) != 1){
+            bytes = 0;
+        }
+        fclose(param);
+    }
+    return bytes > MAX_MSG_BYTES && bytes <= MAX_MSG_LIMIT ? bytes : MAX_MSG_BYTES;
+}
+
+/*
+ * Reading the next message from stdin into Message. Returns its length, 0 at EOF.
+ * Empty lines are skipped, since the device doesn't take empty messages.
+ */
+static int NextMessage(char* Message){
+    static char* Line = NULL;
+    static size_t LineSize = 0;
+    ssize_t length;
+    __u32 prefix;
+
+    if(LengthDelimited){
+        if(fread(&prefix, sizeof(prefix), 1, stdin) != 1){
+            return 0;
+        }
+        if(prefix == 0 || prefix > (__u32)MaxMessage){
+            fprintf(stderr, "Error in message length %u.\n", prefix);
+            exit(1);
+        }
+        if(fread(Message, 1, prefix, stdin) != prefix){
+            fprintf(stderr, "Error in reading message, input ended.\n");
+            exit(1);
+        }
+        return prefix;
+    }
+
+    do{
+        length = getline(&Line, &LineSize, stdin);
+        if(length < 0){
+            return 0;
+        }
+        if(length > 0 && Line[length - 1] == '\n'){
+            length--;
+        }
+    }while(length == 0);
+
+    if(length > MaxMessage){
+        fprintf(stderr, "Error in message length %zd.\n", length);
+        exit(1);
+    }
+    memcpy(Message, Line, length);
+    return length;
+}
+
+/*
+ * Writing one message with write(), moving the fd to its channel first.
+ */
+static void WriteMessage(int file_desc, unsigned long* current, unsigned long channel, const char* Message, int length){
+    if(*current != channel){
+        if(ioctl(file_desc, MSG_SLOT_CHANNEL, channel) < 0){
+            perror("Error in opening device");
+            exit(1);
+        }
+        *current = channel;
+    }
+    if(write(file_desc, Message, length) != length){
+        perror("Error in writing message");
+        exit(1);
+    }
+}
+
+/*
+ * Sending a full batch in one ioctl. Batches never wait, so messages a full queued channel refused are
+ * sent again with a blocking write(), which may put them after later messages of that channel.
+ */
+static void FlushBatch(int file_desc, unsigned long* current, struct msg_slot_batch_entry* entries, int count){
+    struct msg_slot_batch batch = {.entries = (__u64)(unsigned long)entries, .count = count};
+    int i;
+
+    if(count == 0){
+        return;
+    }
+    if(ioctl(file_desc, MSG_SLOT_WRITE_BATCH, &batch) < 0){
+        perror("Error in writing batch");
+        exit(1);
+    }
+
+    for(i = 0; i < count; i++){
+        if(entries[i].result == -EAGAIN){
+            WriteMessage(file_desc, current, entries[i].channel, (char*)(unsigned long)entries[i].buffer, entries[i].length);
+        }else if(entries[i].result < 0){
+            errno = -entries[i].result;
+            perror("Error in writing message");
+            exit(1);
+        }
+    }
+}
+
+static long StreamMessages(int file_desc){
+    struct msg_slot_batch_entry* entries = NULL;
+    struct msg_slot_ring* Ring = NULL;
+    char* Messages;
+    unsigned long current = FirstChannel;
+    unsigned long channel;
+    long sent = 0;
+    int length, count = 0;
+
+    Messages = malloc((size_t)BatchSize * MaxMessage);
+    entries = malloc(BatchSize * sizeof(*entries));
+    if(Messages == NULL || entries == NULL){
+        perror("Error in allocating batch");
+        exit(1);
+    }
+    if(UseRing){
+        Ring = RingMap(file_desc, RING_DEFAULT_ENTRIES);
+        if(Ring == NULL){
+            perror("Error in mapping ring");
+            exit(1);
+        }
+    }
+
+    while((length = NextMessage(Messages + (size_t)count * MaxMessage)) > 0){
+        channel = FirstChannel + sent % Channels;
+        if(UseRing){
+            if(RingPush(file_desc, Ring, Messages, length)){
+                perror("Error in writing message");
+                exit(1);
+            }
+        }else if(BatchSize == 1){
+            WriteMessage(file_desc, &current, channel, Messages, length);
+        }else{
+            entries[count].channel = channel;
+            entries[count].buffer = (__u64)(unsigned long)(Messages + (size_t)count * MaxMessage);
+            entries[count].length = length;
+            entries[count].result = 0;
+            if(++count == BatchSize){
+                FlushBatch(file_desc, &current, entries, count);
+                count = 0;
+            }
+        }
+        sent++;
+    }
+    FlushBatch(file_desc, &current, entries, count);
+
+    free(entries);
+    free(Messages);
+    return sent;
+}
+
+static void ParseStreamOptions(int argc, char* argv[]){
+    int opt;
+
+    optind = 4;
+    while((opt = getopt(argc, argv, "ln:b:r")) != -1){
+        switch(opt){
+            case 'l':
+                LengthDelimited = 1;
+                break;
+            case 'n':
+                Channels = atoi(optarg);
+                break;
+            case 'b':
+                BatchSize = atoi(optarg);
+                break;
+            case 'r':
+                UseRing = 1;
+                break;
+            default:
+                exit(1);
+        }
+    }
+    if(optind != argc || Channels <= 0 || BatchSize <= 0 || BatchSize > MAX_BATCH_ENTRIES ||
+       (UseRing && (Channels != 1 || BatchSize != 1))){
+        fprintf(stderr, "Error in stream arguments.\n");
+        exit(1);
+    }
+}
 
 int main(int argc, char *argv[]){
-    if(argc != 4){
+    int Stream = argc >= 4 && strcmp(argv[3], "--stream") == 0;
+    if(!Stream && argc != 4 && !(argc == 5 && strcmp(argv[4], "ring") == 0)){
         exit(1);
     }
 
@@ -15,13 +231,20 @@ int main(int argc, char *argv[]){
     char* Message = NULL;
     unsigned long Channel;
     int file_desc, ret_val, length;
+    double start;
+    long sent;
 
     FilePath = argv[1];
     Channel = atoi(argv[2]);
     Message = argv[3];
     length = strlen(Message);
+    if(Stream){
+        ParseStreamOptions(argc, argv);
+    }else{
+        UseRing = argc == 5;
+    }
 
-    file_desc = open(FilePath, O_WRONLY);
+    file_desc = open(FilePath, UseRing ? O_RDWR : O_WRONLY); //Shared mapping needs read access too.
     if(file_desc < 0){
         perror("Error in opening file");
         exit(1);
@@ -33,10 +256,29 @@ int main(int argc, char *argv[]){
         exit(1);
     }
 
-    ret_val = write(file_desc,Message,length);
-    if(ret_val != length){
-        perror("Error in writing message");
-        exit(1);
+    if(Stream){
+        FirstChannel = Channel;
+        MaxMessage = MaxMessageBytes();
+        start = NowSeconds();
+        sent = StreamMessages(file_desc);
+        start = NowSeconds() - start;
+        fprintf(stderr, "%ld messages in %.3f seconds, %.0f messages/sec\n", sent, start, start > 0 ? sent / start : 0);
+    }else if(UseRing){
+        struct msg_slot_ring* Ring = RingMap(file_desc, RING_DEFAULT_ENTRIES);
+        if(Ring == NULL){
+            perror("Error in mapping ring");
+            exit(1);
+        }
+        if(RingPush(file_desc, Ring, Message, length)){
+            perror("Error in writing message");
+            exit(1);
+        }
+    }else{
+        ret_val = write(file_desc,Message,length);
+        if(ret_val != length){
+            perror("Error in writing message");
+            exit(1);
+        }
     }
 
     ret_val = close(file_desc);
@@ -47,4 +289,4 @@ int main(int argc, char *argv[]){
 
     close(file_desc);
     return 0;
-}
\ No newline at end of file
+}
@@ -4,224 +4,1780 @@
 #define __MODULE__
 #include "message_slot.h"
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/fs.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/xarray.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/refcount.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/jiffies.h>
+#include <linux/cdev.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/eventfd.h>
+#include <linux/bitops.h>
+#define CREATE_TRACE_POINTS
+#include "message_slot_trace.h"
 MODULE_LICENSE("GPL");
 
 /*
- * We will hold linked list to manage all the messages.
+ * Message is never changed after it is published, so readers can copy it without locking.
+ * Small messages are allocated from the cache of their size class with the payload inline.
+ * Messages above the biggest class keep only this header in a cache, and msg points to a separate buffer.
+ * Readers hold a reference while copying to user space, since the copy may sleep.
+ */
+typedef struct slot_message{
+    struct rcu_head rcu;
+    refcount_t refs;
+    int length;
+    unsigned int size_class;
+    char *msg;
+    char inline_msg[];
+}message;
+
+/*
+ * Counters of a slot, kept per CPU and summed when shown in debugfs.
+ */
+typedef struct slot_counters{
+    unsigned long writes;
+    unsigned long reads;
+    unsigned long bytes_written;
+    unsigned long bytes_read;
+    unsigned long empty_reads;  //Reads that found no message and failed with -EWOULDBLOCK.
+}counters;
+
+/*
+ * State of one minor, created on its first open and kept until the module is unloaded.
+ * Files of the minor point to it, so reads and writes don't look it up.
+ */
+typedef struct slot_state{
+    unsigned int minor;
+    struct xarray messages;    //Channel index, keyed by channel id, so lookup doesn't depend on the number of channels.
+    atomic_long_t count;       //Number of channels.
+    atomic_long_t bytes;       //Memory used by channels, their messages and shared rings.
+    struct list_head lru;      //Channels, least recently used first.
+    spinlock_t lru_lock;
+    counters __percpu *counters;
+    struct xarray watches;     //Watch lists, keyed by channel id. Empty unless a file watches channels.
+    struct mutex watch_lock;   //Serializes changes of watches and fetches of dirty bitmaps.
+}slot;
+
+/*
+ * Watch of a file on a set of channels of its slot.
+ * Every channel has a link in its watch list, and bit i of dirty belongs to links[i].
+ * Writers only set bits, and signal when pending goes from 0 to 1, so a burst of writes costs one wake up.
+ * Writers find watches under RCU, so a watch is freed after it is unlinked and a grace period passed.
+ */
+typedef struct watch_link{
+    struct hlist_node list;     //Position in the watch list of the channel.
+    struct slot_watch *owner;
+    long channel;
+    unsigned int bit;
+}watch_link;
+
+typedef struct slot_watch{
+    struct eventfd_ctx *eventfd;    //NULL when the file only uses fasync.
+    struct fasync_struct **fasync;  //Of the watching file.
+    atomic_t pending;               //Some bit was set since the last fetch.
+    unsigned int count;
+    atomic64_t *dirty;
+    watch_link links[];
+}watch;
+
+/*
+ * Links of the watches of one channel.
+ */
+typedef struct watch_list{
+    struct hlist_head links;
+    struct rcu_head rcu;
+}watch_list;
+
+/*
+ * Open file of a slot. channel is 0 until MSG_SLOT_CHANNEL.
+ */
+typedef struct slot_file{
+    slot *owner;
+    long channel;
+    watch *watches;                 //NULL until MSG_SLOT_WATCH. Changed under the slot watch lock.
+    struct fasync_struct *fasync;
+    struct list_head pins;          //Nodes the file polled, most recent first.
+    struct mutex poll_lock;         //Serializes pinning with the poll_wait() it protects.
+}file_state;
+
+/*
+ * Channel of a slot.
+ * In the default mode it holds only its last message, which readers copy under RCU.
+ * In queued mode it holds a ring of up to depth messages, and every read consumes one.
+ * The lock serializes writers of this channel and protects the ring.
+ * Independently of the mode, a channel may have a shared ring which userspace maps and uses directly.
+ * The index holds one reference to the node, and every lookup, polling file and mapping of the shared ring takes another.
+ * A deleted node leaves the index at once, and is freed after its last user and a grace period.
  */
 typedef struct slot_node{
-    struct slot_node *next;
     long channel;
-    int length;
-    char msg[MAX_MSG_BYTES];
+    slot *owner;
+    struct kref refs;
+    struct rcu_head rcu;
+    int deleted;              //Set when the node leaves the index, under the slot LRU lock.
+    struct list_head lru;     //Position in the slot LRU, least recently used first.
+    unsigned long last_used;  //Jiffies of the last move in the LRU.
+    spinlock_t lock;
+    message __rcu *last;
+    wait_queue_head_t wq; //Readers waiting for a message and writers waiting for room.
+    message **ring;       //NULL unless the channel is queued.
+    unsigned int depth;
+    unsigned int head;
+    unsigned int count;
+    struct msg_slot_ring *shared; //NULL until MSG_SLOT_RING_SETUP, then never replaced.
+    unsigned int shared_size;
+    unsigned long shared_bytes;
+    atomic_long_t writes;       //Counters of the channel, as in counters.
+    atomic_long_t reads;
+    atomic_long_t bytes_written;
+    atomic_long_t bytes_read;
+    atomic_long_t empty_reads;
 }node;
 
 /*
- * Static list that we will update during the runtime of the kernel.
+ * Reference of a file on a node it polled. poll(2) and select(2) leave their entries on the node's wait
+ * queue until the call returns, so the node must not be freed before that.
+ */
+typedef struct poll_pin{
+    struct list_head list;
+    node *pinned;
+}poll_pin;
+
+/*
+ * Inline payload of each message cache. The extra cache holds headers of out of line messages.
+ */
+static const unsigned int MessageClassBytes[] = MESSAGE_CLASS_BYTES;
+#define MESSAGE_CLASSES ARRAY_SIZE(MessageClassBytes)
+static const char *MessageCacheNames[MESSAGE_CLASSES + 1] = {
+    "message_slot_msg16", "message_slot_msg64", "message_slot_msg128", "message_slot_msg512",
+    "message_slot_msg2048", "message_slot_msg_large"
+};
+static struct kmem_cache *MessageCaches[MESSAGE_CLASSES + 1];
+static struct kmem_cache *NodeCache;
+
+/*
+ * Biggest message a channel accepts. Checked against MAX_MSG_LIMIT when the module is loaded.
+ */
+static unsigned int max_msg_bytes = MAX_MSG_BYTES;
+module_param(max_msg_bytes, uint, 0444);
+MODULE_PARM_DESC(max_msg_bytes, "Biggest message in bytes, up to 1048576 (default 128).");
+
+/*
+ * Allocating a message for length bytes from the cache of its size class. The caller fills it.
+ */
+static message *NewSlotMessage(size_t length){
+    message *NewMessage = NULL;
+    unsigned int size_class = 0;
+
+    if(length > max_msg_bytes || length == 0){
+        printk_ratelimited(KERN_ERR "Massage size is illegal.\n");
+        return ERR_PTR(-EMSGSIZE);
+    }
+
+    while(size_class < MESSAGE_CLASSES && length > MessageClassBytes[size_class]){
+        size_class++;
+    }
+    NewMessage = (message*)kmem_cache_alloc(MessageCaches[size_class], GFP_KERNEL);
+    if(NewMessage == NULL){
+        return ERR_PTR(-ENOMEM);
+    }
+
+    NewMessage->msg = NewMessage->inline_msg;
+    if(size_class == MESSAGE_CLASSES){
+        NewMessage->msg = (char*)kvmalloc(length, GFP_KERNEL);
+        if(NewMessage->msg == NULL){
+            kmem_cache_free(MessageCaches[size_class], NewMessage);
+            return ERR_PTR(-ENOMEM);
+        }
+    }
+    refcount_set(&NewMessage->refs, 1);
+    NewMessage->length = length;
+    NewMessage->size_class = size_class;
+    return NewMessage;
+}
+
+/*
+ * Freeing a message nobody else can see.
+ */
+static void FreeMessage(message *OldMessage){
+    if(OldMessage->size_class == MESSAGE_CLASSES){
+        kvfree(OldMessage->msg);
+    }
+    kmem_cache_free(MessageCaches[OldMessage->size_class], OldMessage);
+}
+
+static void FreeMessageRcu(struct rcu_head *head){
+    FreeMessage(container_of(head, message, rcu));
+}
+
+/*
+ * Dropping a reference to a message. The last one frees it after a grace period, since RCU readers
+ * may still be trying to take a reference.
+ */
+static void PutMessage(message *OldMessage){
+    if(OldMessage != NULL && refcount_dec_and_test(&OldMessage->refs)){
+        call_rcu(&OldMessage->rcu, FreeMessageRcu);
+    }
+}
+
+/*
+ * Taking a reference to the last message of a channel. Returns NULL when there is none.
+ * A message whose last reference is gone was already replaced, so we look again.
+ */
+static message *GetLastMessage(node *FoundedNode){
+    message *LastMessage = NULL;
+
+    rcu_read_lock();
+    do{
+        LastMessage = rcu_dereference(FoundedNode->last);
+    }while(LastMessage != NULL && !refcount_inc_not_zero(&LastMessage->refs));
+    rcu_read_unlock();
+
+    return LastMessage;
+}
+
+/*
+ * Memory limit of every slot in bytes, counting channels, their messages and shared rings. 0 is unlimited.
+ */
+static unsigned long slot_quota_bytes = 0;
+module_param(slot_quota_bytes, ulong, 0644);
+MODULE_PARM_DESC(slot_quota_bytes, "Memory limit of a slot in bytes (default 0, unlimited).");
+
+/*
+ * Channels unused for this long may be deleted to make room for new channels and messages. 0 never deletes.
+ */
+static unsigned int evict_idle_ms = 0;
+module_param(evict_idle_ms, uint, 0644);
+MODULE_PARM_DESC(evict_idle_ms, "Delete channels idle for this many ms when a slot needs room (default 0, never).");
+
+/*
+ * The LRU of a channel is refreshed at most once in this many jiffies, so busy channels don't take the LRU lock.
+ */
+#define LRU_REFRESH_JIFFIES (HZ / 10)
+
+/*
+ * Major number of the device. 0 allocates one, which is printed when the module is loaded.
+ */
+static unsigned int major = 0;
+module_param(major, uint, 0444);
+MODULE_PARM_DESC(major, "Major number of the device (default 0, allocated dynamically).");
+
+/*
+ * Number of minors, every one of them a slot. Slots take memory only once opened.
+ */
+static unsigned int max_slots = MINORMASK + 1;
+module_param(max_slots, uint, 0444);
+MODULE_PARM_DESC(max_slots, "Number of slots (default 2^20).");
+
+static dev_t SlotDevice;
+static struct cdev SlotCdev;
+
+/*
+ * Slots that were opened at least once, keyed by minor.
+ */
+static DEFINE_XARRAY(Slots);
+
+/*
+ * debugfs directory of the module, with the slots summary and a channels file per slot.
+ */
+static struct dentry *DebugRoot;
+static struct dentry *DebugChannels;
+
+static int EvictIdleChannel(slot *WorkSlot, node *Keep);
+
+/*
+ * Memory a stored message is charged for.
+ */
+static long MessageBytes(message *StoredMessage){
+    return sizeof(message) + StoredMessage->length;
+}
+
+/*
+ * Charging bytes to a slot. Over the quota, idle channels other than Keep are deleted until the bytes fit.
+ */
+static int ChargeSlot(slot *WorkSlot, long bytes, node *Keep){
+    unsigned long quota = READ_ONCE(slot_quota_bytes);
+
+    while(atomic_long_add_return(bytes, &WorkSlot->bytes) > quota && quota != 0){
+        atomic_long_sub(bytes, &WorkSlot->bytes);
+        if(!EvictIdleChannel(WorkSlot, Keep)){
+            return -EDQUOT;
+        }
+    }
+    return SUCCESS;
+}
+
+static void UnchargeSlot(slot *WorkSlot, long bytes){
+    atomic_long_sub(bytes, &WorkSlot->bytes);
+}
+
+/*
+ * Counting a request in its slot and channel. Empty reads of a missing channel have no node.
+ */
+static void CountWrite(slot *WorkSlot, node *WorkNode, long bytes){
+    this_cpu_inc(WorkSlot->counters->writes);
+    this_cpu_add(WorkSlot->counters->bytes_written, bytes);
+    atomic_long_inc(&WorkNode->writes);
+    atomic_long_add(bytes, &WorkNode->bytes_written);
+}
+
+static void CountRead(slot *WorkSlot, node *WorkNode, long bytes){
+    this_cpu_inc(WorkSlot->counters->reads);
+    this_cpu_add(WorkSlot->counters->bytes_read, bytes);
+    atomic_long_inc(&WorkNode->reads);
+    atomic_long_add(bytes, &WorkNode->bytes_read);
+}
+
+static void CountEmptyRead(slot *WorkSlot, node *WorkNode){
+    this_cpu_inc(WorkSlot->counters->empty_reads);
+    if(WorkNode != NULL){
+        atomic_long_inc(&WorkNode->empty_reads);
+    }
+}
+
+/*
+ * Freeing every message of a node. The node keeps working in last message mode.
+ */
+static void DrainNode(node *WorkNode){
+    message *LastMessage = NULL;
+    message **ring = NULL;
+    unsigned int depth, head, count, i;
+
+    spin_lock(&WorkNode->lock);
+    LastMessage = rcu_dereference_protected(WorkNode->last, lockdep_is_held(&WorkNode->lock));
+    RCU_INIT_POINTER(WorkNode->last, NULL);
+    ring = WorkNode->ring;
+    depth = WorkNode->depth;
+    head = WorkNode->head;
+    count = WorkNode->count;
+    WorkNode->ring = NULL;
+    WorkNode->depth = WorkNode->head = WorkNode->count = 0;
+    spin_unlock(&WorkNode->lock);
+
+    if(LastMessage != NULL){
+        UnchargeSlot(WorkNode->owner, MessageBytes(LastMessage));
+        PutMessage(LastMessage);
+    }
+    for(i = 0; i < count; i++){
+        UnchargeSlot(WorkNode->owner, MessageBytes(ring[(head + i) % depth]));
+        PutMessage(ring[(head + i) % depth]);
+    }
+    kfree(ring);
+}
+
+static void FreeNodeRcu(struct rcu_head *head){
+    node *OldNode = container_of(head, node, rcu);
+    vfree(OldNode->shared);
+    kmem_cache_free(NodeCache, OldNode);
+}
+
+/*
+ * Freeing a node after its last reference. Polling files pin the nodes they wait on, so the POLLFREE
+ * wake up is only a safeguard for epoll, and the memory is freed after a grace period.
+ */
+static void NodeRelease(struct kref *ref){
+    node *OldNode = container_of(ref, node, refs);
+
+    DrainNode(OldNode); //Messages queued after the node was deleted.
+    UnchargeSlot(OldNode->owner, sizeof(node) + OldNode->shared_bytes);
+    wake_up_pollfree(&OldNode->wq);
+    call_rcu(&OldNode->rcu, FreeNodeRcu);
+}
+
+static void PutNode(node *OldNode){
+    kref_put(&OldNode->refs, NodeRelease);
+}
+
+/*
+ * Finding message by slot and and channel. Returns a referenced node, which the caller puts.
+ */
+static int GetNode(slot *WorkSlot, long channel,node **NodePointer){
+    rcu_read_lock();
+    *NodePointer = xa_load(&WorkSlot->messages, (unsigned long)channel);
+    if(*NodePointer != NULL && !kref_get_unless_zero(&(*NodePointer)->refs)){
+        *NodePointer = NULL; //Deleted, and about to be freed.
+    }
+    rcu_read_unlock();
+    return *NodePointer != NULL;
+}
+
+/*
+ * Moving a node to the end of its slot LRU. Done at most once per LRU_REFRESH_JIFFIES.
+ */
+static void TouchNode(node *WorkNode){
+    slot *WorkSlot = WorkNode->owner;
+
+    if(!time_after(jiffies, READ_ONCE(WorkNode->last_used) + LRU_REFRESH_JIFFIES)){
+        return;
+    }
+    spin_lock(&WorkSlot->lru_lock);
+    if(!WorkNode->deleted){
+        list_move_tail(&WorkNode->lru, &WorkSlot->lru);
+        WRITE_ONCE(WorkNode->last_used, jiffies);
+    }
+    spin_unlock(&WorkSlot->lru_lock);
+}
+
+/*
+ * Removing a node from the slot index and freeing its messages.
+ * Fails if the node was already deleted. Users holding a reference see an empty channel.
+ */
+static int DeleteNode(node *WorkNode){
+    slot *WorkSlot = WorkNode->owner;
+
+    if(xa_cmpxchg(&WorkSlot->messages, (unsigned long)WorkNode->channel, WorkNode, NULL, 0) != WorkNode){
+        return -ENOENT;
+    }
+    atomic_long_dec(&WorkSlot->count);
+
+    spin_lock(&WorkSlot->lru_lock);
+    list_del_init(&WorkNode->lru);
+    WorkNode->deleted = TRUE;
+    spin_unlock(&WorkSlot->lru_lock);
+
+    DrainNode(WorkNode);
+    wake_up_interruptible_all(&WorkNode->wq); //Waiters must see the channel is gone.
+    PutNode(WorkNode); //Reference of the index.
+    return SUCCESS;
+}
+
+/*
+ * Deleting the least recently used channel of a slot if it was idle for evict_idle_ms.
+ * Channels with waiters or a shared ring are in use even when idle. Returns TRUE if a channel was deleted.
+ */
+static int EvictIdleChannel(slot *WorkSlot, node *Keep){
+    unsigned int idle_ms = READ_ONCE(evict_idle_ms);
+    node *WorkNode = NULL;
+    node *Victim = NULL;
+
+    if(idle_ms == 0){
+        return FALSE;
+    }
+
+    spin_lock(&WorkSlot->lru_lock);
+    list_for_each_entry(WorkNode, &WorkSlot->lru, lru){
+        if(!time_after(jiffies, WorkNode->last_used + msecs_to_jiffies(idle_ms))){
+            break; //The rest were used later.
+        }
+        if(WorkNode == Keep || READ_ONCE(WorkNode->shared) != NULL || wq_has_sleeper(&WorkNode->wq)){
+            continue;
+        }
+        if(kref_get_unless_zero(&WorkNode->refs)){
+            Victim = WorkNode;
+            break;
+        }
+    }
+    spin_unlock(&WorkSlot->lru_lock);
+
+    if(Victim == NULL){
+        return FALSE;
+    }
+    DeleteNode(Victim); //May lose to another deletion, which made room just as well.
+    PutNode(Victim);
+    return TRUE;
+}
+
+/*
+ * Deleting a channel of a slot.
+ */
+static long DeleteChannel(slot *WorkSlot, long channel){
+    node *WorkNode = NULL;
+    int ret_val;
+
+    if(!GetNode(WorkSlot, channel, &WorkNode)){
+        return -ENOENT;
+    }
+    ret_val = DeleteNode(WorkNode);
+    PutNode(WorkNode);
+    return ret_val;
+}
+
+/*
+ * Adding new channel to the slot index. Returns a referenced node.
+ * Another writer may add the same channel first. In that case we return its node.
+ * Each new channel may reclaim one idle channel, so churning channel ids don't grow the slot.
+ */
+static int AddNode(slot *WorkSlot, long channel, node **NodePointer){
+    node *NewNode = NULL;
+    int ret_val;
+
+    EvictIdleChannel(WorkSlot, NULL);
+    if(atomic_long_inc_return(&WorkSlot->count) > CHANNEL_NUMBER){
+        atomic_long_dec(&WorkSlot->count);
+        printk_ratelimited(KERN_ERR "We support only 2^20 channels per slot.\n");
+        return FAIL;
+    }
+    if(ChargeSlot(WorkSlot, sizeof(node), NULL)){
+        atomic_long_dec(&WorkSlot->count);
+        printk_ratelimited(KERN_ERR "Slot memory quota exceeded.\n");
+        return FAIL;
+    }
+
+    NewNode = (node*)kmem_cache_zalloc(NodeCache, GFP_KERNEL);
+    if(NewNode == NULL){
+        atomic_long_dec(&WorkSlot->count);
+        UnchargeSlot(WorkSlot, sizeof(node));
+        printk_ratelimited(KERN_ERR "Can't create new message slot.\n");
+        return FAIL;
+    }
+
+    NewNode -> channel = channel;
+    NewNode -> owner = WorkSlot;
+    kref_init(&NewNode->refs);
+    kref_get(&NewNode->refs); //One for the index, one for the caller.
+    INIT_LIST_HEAD(&NewNode->lru);
+    NewNode -> last_used = jiffies;
+    spin_lock_init(&NewNode->lock);
+    init_waitqueue_head(&NewNode->wq);
+    RCU_INIT_POINTER(NewNode->last, NULL);
+    ret_val = xa_insert(&WorkSlot->messages, (unsigned long)channel, NewNode, GFP_KERNEL);
+    if(ret_val){
+        atomic_long_dec(&WorkSlot->count);
+        UnchargeSlot(WorkSlot, sizeof(node));
+        kmem_cache_free(NodeCache, NewNode);
+        if(ret_val == -EBUSY && GetNode(WorkSlot, channel, NodePointer)){ //Lost the race.
+            return SUCCESS;
+        }
+        printk_ratelimited(KERN_ERR "Can't index new channel.\n");
+        return FAIL;
+    }
+
+    spin_lock(&WorkSlot->lru_lock);
+    if(!NewNode->deleted){ //May already be deleted by its channel id.
+        list_add_tail(&NewNode->lru, &WorkSlot->lru);
+    }
+    spin_unlock(&WorkSlot->lru_lock);
+
+    *NodePointer = NewNode;
+    return SUCCESS;
+}
+
+/*
+ * Finding a channel, adding it if it doesn't exist yet. Returns a referenced node.
+ */
+static int GetChannelNode(slot *WorkSlot, long channel, node **NodePointer){
+    if(GetNode(WorkSlot, channel, NodePointer)){
+        return SUCCESS;
+    }
+    return AddNode(WorkSlot, channel, NodePointer);
+}
+
+/*
+ * Slot and channel of an open file.
+ */
+static slot *FileSlot(struct file *file){
+    return ((file_state*)file->private_data)->owner;
+}
+
+static long FileChannel(struct file *file){
+    return READ_ONCE(((file_state*)file->private_data)->channel);
+}
+
+/*
+ * Finding the channel of the file, adding it if it doesn't exist yet. Returns a referenced node.
+ */
+static int GetFileNode(struct file *file, node **NodePointer){
+    return GetChannelNode(FileSlot(file), FileChannel(file), NodePointer);
+}
+
+/*
+ * Setting the queue depth of the file's channel. Depth 0 returns the channel to the last message mode.
+ * Queued messages are kept, so the ring can't shrink below the number of waiting messages.
+ */
+static long SetQueueDepth(struct file *file, unsigned long depth){
+    node *WorkNode = NULL;
+    message **NewRing = NULL;
+    message **OldRing = NULL;
+    message *OldMessage = NULL;
+    unsigned int i;
+
+    if(depth > MAX_QUEUE_DEPTH){
+        printk_ratelimited(KERN_ERR "Queue depth is too big.\n");
+        return -EINVAL;
+    }
+
+    if(GetFileNode(file, &WorkNode)){
+        return -ENOMEM;
+    }
+
+    if(depth != 0){
+        NewRing = (message**)kcalloc(depth, sizeof(message*), GFP_KERNEL);
+        if(NewRing == NULL){
+            PutNode(WorkNode);
+            return -ENOMEM;
+        }
+    }
+
+    spin_lock(&WorkNode->lock);
+    if(WorkNode->count > depth){
+        spin_unlock(&WorkNode->lock);
+        kfree(NewRing);
+        PutNode(WorkNode);
+        return -EBUSY;
+    }
+
+    for(i = 0; i < WorkNode->count; i++){
+        NewRing[i] = WorkNode->ring[(WorkNode->head + i) % WorkNode->depth];
+    }
+    OldRing = WorkNode->ring;
+    WorkNode->ring = NewRing;
+    WorkNode->depth = depth;
+    WorkNode->head = 0;
+
+    if(depth != 0){ //Queued reads never look at the last message, so it would only go stale.
+        OldMessage = rcu_dereference_protected(WorkNode->last, lockdep_is_held(&WorkNode->lock));
+        RCU_INIT_POINTER(WorkNode->last, NULL);
+    }
+    spin_unlock(&WorkNode->lock);
+
+    kfree(OldRing);
+    if(OldMessage != NULL){
+        UnchargeSlot(WorkNode->owner, MessageBytes(OldMessage));
+        PutMessage(OldMessage);
+    }
+    wake_up_interruptible(&WorkNode->wq); //Waiters must recheck the new mode.
+    PutNode(WorkNode);
+    return SUCCESS;
+}
+
+/*
+ * Bytes of a shared ring with size entries, rounded up to whole pages for mmap.
+ */
+static unsigned long RingBytes(unsigned long size){
+    return PAGE_ALIGN(sizeof(struct msg_slot_ring) + size * sizeof(struct msg_slot_ring_entry));
+}
+
+/*
+ * Setting up the shared ring of the file's channel. Returns the number of bytes to mmap.
+ * A channel keeps its first ring, so a mapping never points to freed memory.
+ */
+static long SetupSharedRing(struct file *file, unsigned long size){
+    node *WorkNode = NULL;
+    struct msg_slot_ring *NewRing = NULL;
+    unsigned long bytes;
+    long ret_val;
+
+    if(size == 0 || size > MAX_RING_ENTRIES || !is_power_of_2(size)){
+        printk_ratelimited(KERN_ERR "Ring size must be a power of 2 up to %d.\n", MAX_RING_ENTRIES);
+        return -EINVAL;
+    }
+
+    if(GetFileNode(file, &WorkNode)){
+        return -ENOMEM;
+    }
+
+    if(smp_load_acquire(&WorkNode->shared) != NULL){ //Already set up by the other side.
+        ret_val = WorkNode->shared_bytes;
+        PutNode(WorkNode);
+        return ret_val;
+    }
+
+    bytes = RingBytes(size);
+    ret_val = ChargeSlot(WorkNode->owner, bytes, WorkNode);
+    if(ret_val){
+        PutNode(WorkNode);
+        return ret_val;
+    }
+    NewRing = (struct msg_slot_ring*)vmalloc_user(bytes); //Zeroed, so head == tail.
+    if(NewRing == NULL){
+        UnchargeSlot(WorkNode->owner, bytes);
+        PutNode(WorkNode);
+        return -ENOMEM;
+    }
+    NewRing->size = size;
+
+    spin_lock(&WorkNode->lock);
+    if(WorkNode->shared == NULL){
+        WorkNode->shared_size = size;
+        WorkNode->shared_bytes = bytes;
+        smp_store_release(&WorkNode->shared, NewRing);
+        NewRing = NULL;
+    }
+    spin_unlock(&WorkNode->lock);
+
+    if(NewRing != NULL){
+        UnchargeSlot(WorkNode->owner, bytes);
+        vfree(NewRing);
+    }
+    ret_val = WorkNode->shared_bytes;
+    PutNode(WorkNode);
+    return ret_val;
+}
+
+/*
+ * Finding the channel of the file if it has a shared ring. Returns a referenced node.
+ */
+static node *GetSharedRingNode(struct file *file){
+    node *WorkNode = NULL;
+    if(!GetNode(FileSlot(file), FileChannel(file), &WorkNode)){
+        return NULL;
+    }
+    if(smp_load_acquire(&WorkNode->shared) == NULL){
+        PutNode(WorkNode);
+        return NULL;
+    }
+    return WorkNode;
+}
+
+/*
+ * Ring state as seen by the kernel. The size userspace sees can't be trusted, so we use our own copy.
+ */
+static int SharedRingReadable(node *WorkNode){
+    return READ_ONCE(WorkNode->shared->head) != READ_ONCE(WorkNode->shared->tail);
+}
+
+static int SharedRingWritable(node *WorkNode){
+    return READ_ONCE(WorkNode->shared->head) - READ_ONCE(WorkNode->shared->tail) < WorkNode->shared_size;
+}
+
+/*
+ * Sleeping until the shared ring has a message (RING_READABLE) or room for one (RING_WRITABLE).
+ */
+static long WaitSharedRing(struct file *file, unsigned long condition){
+    node *WorkNode = GetSharedRingNode(file);
+    long ret_val;
+    if(WorkNode == NULL){
+        printk_ratelimited(KERN_ERR "Please set up the ring first.\n");
+        return -EINVAL;
+    }
+
+    switch(condition){
+        case RING_READABLE:
+            ret_val = wait_event_interruptible(WorkNode->wq, SharedRingReadable(WorkNode) || WorkNode->deleted);
+            break;
+        case RING_WRITABLE:
+            ret_val = wait_event_interruptible(WorkNode->wq, SharedRingWritable(WorkNode) || WorkNode->deleted);
+            break;
+        default:
+            ret_val = -EINVAL;
+    }
+    PutNode(WorkNode);
+    return ret_val;
+}
+
+/*
+ * Waking the other side of the shared ring.
+ */
+static long WakeSharedRing(struct file *file){
+    node *WorkNode = GetSharedRingNode(file);
+    if(WorkNode == NULL){
+        printk_ratelimited(KERN_ERR "Please set up the ring first.\n");
+        return -EINVAL;
+    }
+
+    wake_up_interruptible(&WorkNode->wq);
+    PutNode(WorkNode);
+    return SUCCESS;
+}
+
+/*
+ * Marking a written channel dirty in every watch on it. Slots nobody watches only pay the emptiness check.
+ */
+static void NotifyWatches(slot *WorkSlot, long channel){
+    watch_list *List = NULL;
+    watch_link *Link = NULL;
+    watch *Watch = NULL;
+    u64 bit;
+
+    if(xa_empty(&WorkSlot->watches)){
+        return;
+    }
+
+    rcu_read_lock();
+    List = xa_load(&WorkSlot->watches, channel);
+    if(List != NULL){
+        hlist_for_each_entry_rcu(Link, &List->links, list){
+            Watch = Link->owner;
+            bit = BIT_ULL(Link->bit % 64);
+            if(atomic64_fetch_or(bit, &Watch->dirty[Link->bit / 64]) & bit){
+                continue; //Still dirty from an earlier write.
+            }
+            if(atomic_xchg(&Watch->pending, 1) == 0){
+                if(Watch->eventfd != NULL){
+                    eventfd_signal(Watch->eventfd);
+                }
+                kill_fasync(Watch->fasync, SIGIO, POLL_IN);
+            }
+        }
+    }
+    rcu_read_unlock();
+}
+
+static void FreeWatch(watch *Watch){
+    if(Watch->eventfd != NULL){
+        eventfd_ctx_put(Watch->eventfd);
+    }
+    kvfree(Watch->dirty);
+    kvfree(Watch);
+}
+
+/*
+ * Removing the first count links of a watch from their channels. Called with the slot watch lock held.
+ * Lists left empty leave the index and are freed after a grace period.
+ */
+static void UnlinkWatch(slot *WorkSlot, watch *Watch, unsigned int count){
+    watch_list *List = NULL;
+    unsigned int i;
+
+    for(i = 0; i < count; i++){
+        List = xa_load(&WorkSlot->watches, Watch->links[i].channel);
+        hlist_del_rcu(&Watch->links[i].list);
+        if(hlist_empty(&List->links)){
+            xa_erase(&WorkSlot->watches, Watch->links[i].channel);
+            kfree_rcu(List, rcu);
+        }
+    }
+}
+
+/*
+ * Adding every link of a watch to the list of its channel. Called with the slot watch lock held.
+ */
+static int LinkWatch(slot *WorkSlot, watch *Watch){
+    watch_list *List = NULL;
+    unsigned int i;
+    int ret_val;
+
+    for(i = 0; i < Watch->count; i++){
+        List = xa_load(&WorkSlot->watches, Watch->links[i].channel);
+        if(List == NULL){
+            List = (watch_list*)kmalloc(sizeof(watch_list), GFP_KERNEL);
+            if(List == NULL){
+                UnlinkWatch(WorkSlot, Watch, i);
+                return -ENOMEM;
+            }
+            INIT_HLIST_HEAD(&List->links);
+            ret_val = xa_err(xa_store(&WorkSlot->watches, Watch->links[i].channel, List, GFP_KERNEL));
+            if(ret_val){
+                kfree(List);
+                UnlinkWatch(WorkSlot, Watch, i);
+                return ret_val;
+            }
+        }
+        hlist_add_head_rcu(&Watch->links[i].list, &List->links);
+    }
+    return SUCCESS;
+}
+
+/*
+ * Building a watch from a MSG_SLOT_WATCH request. Returns NULL for an empty request.
  */
-static node *messages[MAX_SLOTS_NUMBER]={0};
+static watch *NewWatch(file_state *State, struct msg_slot_watch *request){
+    u64 __user *channels = (u64 __user*)(unsigned long)request->channels;
+    watch *Watch = NULL;
+    u64 channel;
+    unsigned int i;
+    int ret_val = -EINVAL;
+
+    if(request->count == 0){
+        return NULL;
+    }
+    if(request->count > MAX_WATCH_CHANNELS){
+        printk_ratelimited(KERN_ERR "Watch is too big.\n");
+        return ERR_PTR(-EINVAL);
+    }
+
+    Watch = (watch*)kvzalloc(struct_size(Watch, links, request->count), GFP_KERNEL);
+    if(Watch == NULL){
+        return ERR_PTR(-ENOMEM);
+    }
+    Watch->dirty = (atomic64_t*)kvcalloc(DIV_ROUND_UP(request->count, 64), sizeof(atomic64_t), GFP_KERNEL);
+    if(Watch->dirty == NULL){
+        kvfree(Watch);
+        return ERR_PTR(-ENOMEM);
+    }
+    Watch->count = request->count;
+    Watch->fasync = &State->fasync;
+    atomic_set(&Watch->pending, 0);
+
+    for(i = 0; i < Watch->count; i++){
+        if(get_user(channel, channels + i)){
+            ret_val = -EFAULT;
+            goto fail;
+        }
+        if(channel == 0){
+            printk_ratelimited(KERN_ERR "0 id not supported");
+            goto fail;
+        }
+        Watch->links[i].owner = Watch;
+        Watch->links[i].channel = (long)channel;
+        Watch->links[i].bit = i;
+    }
+
+    if(request->eventfd >= 0){
+        Watch->eventfd = eventfd_ctx_fdget(request->eventfd);
+        if(IS_ERR(Watch->eventfd)){
+            ret_val = PTR_ERR(Watch->eventfd);
+            Watch->eventfd = NULL;
+            goto fail;
+        }
+    }
+    return Watch;
+
+fail:
+    FreeWatch(Watch);
+    return ERR_PTR(ret_val);
+}
 
 /*
- * Static array which holds the number of channels in each slot.
+ * Replacing the watch of a file. The old watch is freed once writers can no longer see it.
  */
-static long CounterArray[MAX_SLOTS_NUMBER];
+static long SetWatch(struct file *file, unsigned long param){
+    file_state *State = (file_state*)file->private_data;
+    slot *WorkSlot = State->owner;
+    struct msg_slot_watch request;
+    watch *Watch = NULL;
+    watch *OldWatch = NULL;
+    int ret_val;
+
+    if(copy_from_user(&request, (void __user*)param, sizeof(request))){
+        return -EFAULT;
+    }
+    Watch = NewWatch(State, &request);
+    if(IS_ERR(Watch)){
+        return PTR_ERR(Watch);
+    }
+
+    mutex_lock(&WorkSlot->watch_lock);
+    if(Watch != NULL){
+        ret_val = LinkWatch(WorkSlot, Watch);
+        if(ret_val){
+            mutex_unlock(&WorkSlot->watch_lock);
+            synchronize_rcu(); //Links LinkWatch() published before failing may still be walked by writers.
+            FreeWatch(Watch);
+            return ret_val;
+        }
+    }
+    OldWatch = State->watches;
+    State->watches = Watch;
+    if(OldWatch != NULL){
+        UnlinkWatch(WorkSlot, OldWatch, OldWatch->count);
+    }
+    mutex_unlock(&WorkSlot->watch_lock);
+
+    if(OldWatch != NULL){
+        synchronize_rcu();
+        FreeWatch(OldWatch);
+    }
+    return SUCCESS;
+}
 
 /*
- * Finding message by slot and and channel.
+ * Copying the dirty bitmap of a file's watch to user space and clearing it.
+ * pending is cleared before the bits, so a write that lands after its bit was taken signals again.
  */
-static int GetNode(int minor, long channel,node **NodePointer){
-    node *WantedNode;
-    if(messages[minor] == NULL){
-        *NodePointer = NULL;
-        return FALSE;
+static long FetchDirty(struct file *file, unsigned long param){
+    file_state *State = (file_state*)file->private_data;
+    slot *WorkSlot = State->owner;
+    struct msg_slot_dirty request;
+    u64 __user *bitmap;
+    watch *Watch = NULL;
+    unsigned int words, i;
+    long dirty = 0;
+    u64 word;
+
+    if(copy_from_user(&request, (void __user*)param, sizeof(request))){
+        return -EFAULT;
+    }
+    bitmap = (u64 __user*)(unsigned long)request.bitmap;
+
+    mutex_lock(&WorkSlot->watch_lock);
+    Watch = State->watches;
+    if(Watch == NULL){
+        mutex_unlock(&WorkSlot->watch_lock);
+        printk_ratelimited(KERN_ERR "Please set a watch first.\n");
+        return -EINVAL;
+    }
+    words = DIV_ROUND_UP(Watch->count, 64);
+    if(request.words < words){
+        mutex_unlock(&WorkSlot->watch_lock);
+        return -ENOSPC;
     }
 
-    WantedNode = messages[minor];
-    while(WantedNode != NULL){
-        if(WantedNode->channel == channel){
-            *NodePointer = WantedNode;
-            return TRUE;
+    atomic_xchg(&Watch->pending, 0);
+    for(i = 0; i < words; i++){
+        word = atomic64_xchg(&Watch->dirty[i], 0);
+        if(put_user(word, bitmap + i)){
+            atomic64_or(word, &Watch->dirty[i]); //Not delivered, so still dirty.
+            dirty = -EFAULT;
+            break;
+        }
+        dirty += hweight64(word);
+    }
+    mutex_unlock(&WorkSlot->watch_lock);
+    return dirty;
+}
+
+/*
+ * Adding a message to a queued channel. Called with the channel lock held, returns with it released.
+ * Waits for room unless nonblock is set.
+ */
+static int QueueMessage(node *WorkNode, message *NewMessage, int nonblock){
+    int ret_val;
+
+    while(WorkNode->ring != NULL && WorkNode->count == WorkNode->depth){
+        spin_unlock(&WorkNode->lock);
+        if(nonblock){
+            return -EAGAIN;
+        }
+        ret_val = wait_event_interruptible(WorkNode->wq,
+                READ_ONCE(WorkNode->ring) == NULL || READ_ONCE(WorkNode->count) < READ_ONCE(WorkNode->depth));
+        if(ret_val){
+            return ret_val;
         }
+        spin_lock(&WorkNode->lock);
+    }
 
-        WantedNode = WantedNode->next;
+    if(WorkNode->ring == NULL){ //Channel left queued mode while we waited.
+        spin_unlock(&WorkNode->lock);
+        return -EAGAIN;
     }
-    *NodePointer = NULL;
-    return FALSE;
+
+    WorkNode->ring[(WorkNode->head + WorkNode->count) % WorkNode->depth] = NewMessage;
+    WorkNode->count++;
+    spin_unlock(&WorkNode->lock);
+    return SUCCESS;
 }
 
 /*
- * Adding new massage slot and id. If slot is NULL we create it, else we are adding new channel.
- * We will check channel does not exist before calling the function.
+ * Publishing a filled message on a channel. Takes ownership of the message.
+ * The message replaces the last message with one pointer swap, so readers see either the old or the
+ * new message, never a mix. Queued channels append the message to their ring instead.
+ * A channel deleted before we take its lock is looked up again, so the message isn't lost with it.
  */
-static int AddNode(int minor, long channel, node **NodePointer){
-    node *NewNode = NULL;
-    node *head = NULL;
+static ssize_t WriteChannel(slot *WorkSlot, long channel, message *NewMessage, int nonblock){
+    int ret_val;
+    size_t length = NewMessage->length;
+    node *WorkNode = NULL;
+    message *OldMessage = NULL;
 
-    if(CounterArray[minor] >= CHANNEL_NUMBER){
-        printk(KERN_ERR "We support only 2^20 channels per slot.\n");
-        return FAIL;
+    do{
+        ret_val = GetChannelNode(WorkSlot, channel, &WorkNode);
+        if(ret_val){ //Error in making node.
+            FreeMessage(NewMessage);
+            return ret_val;
+        }
+
+        ret_val = ChargeSlot(WorkSlot, MessageBytes(NewMessage), WorkNode);
+        if(ret_val){
+            FreeMessage(NewMessage);
+            PutNode(WorkNode);
+            return ret_val;
+        }
+
+        spin_lock(&WorkNode->lock);
+        if(READ_ONCE(WorkNode->deleted)){
+            spin_unlock(&WorkNode->lock);
+            UnchargeSlot(WorkSlot, MessageBytes(NewMessage));
+            PutNode(WorkNode);
+            WorkNode = NULL;
+        }
+    }while(WorkNode == NULL);
+
+    if(WorkNode->ring != NULL){
+        ret_val = QueueMessage(WorkNode, NewMessage, nonblock);
+        if(ret_val){
+            UnchargeSlot(WorkSlot, MessageBytes(NewMessage));
+            FreeMessage(NewMessage);
+            PutNode(WorkNode);
+            return ret_val;
+        }
+    }else{
+        OldMessage = rcu_dereference_protected(WorkNode->last, lockdep_is_held(&WorkNode->lock));
+        rcu_assign_pointer(WorkNode->last, NewMessage);
+        spin_unlock(&WorkNode->lock);
     }
 
-    NewNode = (node*)kmalloc(sizeof(node), GFP_KERNEL);
-    if(NewNode == NULL){
-        printk(KERN_ERR "Can't create new message slot.\n");
-        return FAIL;
+    if(OldMessage != NULL){
+        UnchargeSlot(WorkSlot, MessageBytes(OldMessage));
+        PutMessage(OldMessage); //Readers may still be copying it.
     }
+    if(wq_has_sleeper(&WorkNode->wq)){
+        wake_up_interruptible(&WorkNode->wq);
+    }
+    NotifyWatches(WorkSlot, channel);
+    CountWrite(WorkSlot, WorkNode, length);
+    TouchNode(WorkNode);
+    PutNode(WorkNode);
 
-    NewNode -> length = 0;
-    NewNode -> next = NULL;
-    NewNode -> channel = channel;
-    *NodePointer = NewNode;
-    if(messages[minor] != 0){
-        head = messages[minor];
-        NewNode->next = head;
+    return length;
+}
+
+/*
+ * Taking the oldest message of a queued channel. Called with the channel lock held, returns with it
+ * released. The caller owns the returned message. Waits for a message unless nonblock is set.
+ */
+static message *DequeueMessage(node *FoundedNode, size_t length, int nonblock){
+    message *OldestMessage = NULL;
+    int ret_val;
+
+    while(FoundedNode->ring != NULL && FoundedNode->count == 0){
+        spin_unlock(&FoundedNode->lock);
+        if(nonblock){
+            return ERR_PTR(-EWOULDBLOCK);
+        }
+        ret_val = wait_event_interruptible(FoundedNode->wq,
+                READ_ONCE(FoundedNode->ring) == NULL || READ_ONCE(FoundedNode->count) != 0);
+        if(ret_val){
+            return ERR_PTR(ret_val);
+        }
+        spin_lock(&FoundedNode->lock);
     }
-    messages[minor] = NewNode;
-    CounterArray[minor] +=1;
-    return SUCCESS;
+
+    if(FoundedNode->ring == NULL){ //Channel left queued mode while we waited.
+        spin_unlock(&FoundedNode->lock);
+        return ERR_PTR(-EWOULDBLOCK);
+    }
+
+    OldestMessage = FoundedNode->ring[FoundedNode->head];
+    if(OldestMessage->length > length){ //Message stays queued for a bigger buffer.
+        spin_unlock(&FoundedNode->lock);
+        printk_ratelimited(KERN_ERR "Msg read too long.\n");
+        return ERR_PTR(-ENOSPC);
+    }
+    FoundedNode->head = (FoundedNode->head + 1) % FoundedNode->depth;
+    FoundedNode->count--;
+    spin_unlock(&FoundedNode->lock);
+    UnchargeSlot(FoundedNode->owner, MessageBytes(OldestMessage));
+
+    if(wq_has_sleeper(&FoundedNode->wq)){
+        wake_up_interruptible(&FoundedNode->wq);
+    }
+
+    return OldestMessage; //Nobody else can see a dequeued message.
 }
 
 /*
- * Custom ioctl command.
+ * Reading a channel. Returns a referenced message of at most length bytes, which the caller copies
+ * and puts. The last message is found under RCU without locking. Queued channels consume their oldest
+ * message instead.
  */
-static long device_ioctl(struct file *file,unsigned int ioctl_command_id,unsigned long ioctl_command_param){
-    if(file == NULL){
-        printk(KERN_ERR "Error in ioctl arguments");
-        return -EINVAL;
+static message *ReadChannel(slot *WorkSlot, long channel, size_t length, int nonblock){
+    int ret_val;
+    node *FoundedNode = NULL;
+    message *LastMessage = NULL;
+
+    ret_val = GetNode(WorkSlot, channel, &FoundedNode);
+    if(!ret_val){ //Common under polling loops, so it is only counted.
+        CountEmptyRead(WorkSlot, NULL);
+        return ERR_PTR(-EWOULDBLOCK);
     }
 
-    if(ioctl_command_param == 0){
-        printk(KERN_ERR "0 id not supported");
-        return -EINVAL;
+    TouchNode(FoundedNode);
+    if(READ_ONCE(FoundedNode->ring) != NULL){
+        spin_lock(&FoundedNode->lock);
+        if(FoundedNode->ring != NULL){
+            LastMessage = DequeueMessage(FoundedNode, length, nonblock);
+        }else{
+            spin_unlock(&FoundedNode->lock);
+        }
     }
 
-    if(ioctl_command_id != MSG_SLOT_CHANNEL){
-        printk(KERN_ERR "Not supported");
-        return -EINVAL;
+    if(LastMessage == NULL){
+        LastMessage = GetLastMessage(FoundedNode);
+        if(LastMessage == NULL){
+            LastMessage = ERR_PTR(-EWOULDBLOCK);
+        }else if(LastMessage->length > length){
+            PutMessage(LastMessage);
+            printk_ratelimited(KERN_ERR "Msg read too long.\n");
+            LastMessage = ERR_PTR(-ENOSPC);
+        }
     }
 
-    file->private_data = (void*)ioctl_command_param;
-    return SUCCESS;
+    if(!IS_ERR(LastMessage)){
+        CountRead(WorkSlot, FoundedNode, LastMessage->length);
+    }else if(PTR_ERR(LastMessage) == -EWOULDBLOCK){
+        CountEmptyRead(WorkSlot, FoundedNode);
+    }
+    PutNode(FoundedNode);
+    return LastMessage;
+}
+
+/*
+ * File is non blocking for this request, including io_uring's non blocking attempts.
+ */
+static int IsNonBlocking(struct kiocb *iocb){
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
 }
 
 /*
- * Device write function.
+ * Device write function. Serves write(), writev() and io_uring. The whole iterator is one message.
  */
-static ssize_t device_write(struct file *file,const char __user* buffer,size_t length,loff_t* offset){
-    int ret_val, minor;
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from){
+    struct file *file = iocb->ki_filp;
+    u64 start = trace_message_slot_write_enabled() ? ktime_get_ns() : 0; //Timed only while traced.
     long channel;
-    node *WorkNode = NULL;
-    if(file == NULL || buffer == NULL){
-        printk(KERN_ERR "Error in device_write arguments.\n");
+    ssize_t ret_val;
+    message *NewMessage = NULL;
+
+    channel = FileChannel(file);
+    if(channel  == 0){
+        printk_ratelimited(KERN_ERR "Please set ioctl first.\n");
         return -EINVAL;
     }
 
-    channel = (long)file->private_data;
+    NewMessage = NewSlotMessage(iov_iter_count(from));
+    if(IS_ERR(NewMessage)){
+        ret_val = PTR_ERR(NewMessage);
+    }else if(!copy_from_iter_full(NewMessage->msg, NewMessage->length, from)){
+        FreeMessage(NewMessage);
+        ret_val = -EFAULT;
+    }else{
+        ret_val = WriteChannel(FileSlot(file), channel, NewMessage, IsNonBlocking(iocb));
+    }
+
+    if(start != 0){
+        trace_message_slot_write(FileSlot(file)->minor, channel, ret_val, ktime_get_ns() - start);
+    }
+    return ret_val;
+}
+
+/*
+ * Device read function. Serves read(), readv() and io_uring.
+ */
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to){
+    struct file *file = iocb->ki_filp;
+    u64 start = trace_message_slot_read_enabled() ? ktime_get_ns() : 0; //Timed only while traced.
+    long channel;
+    ssize_t msg_length;
+    message *LastMessage = NULL;
+
+    channel = FileChannel(file);
     if(channel  == 0){
-        printk(KERN_ERR "Please set ioctl first.\n");
+        printk_ratelimited(KERN_ERR "Please set ioctl first.\n");
         return -EINVAL;
     }
 
-    if(length > MAX_MSG_BYTES || length == 0){
-        printk(KERN_ERR "Massage size is illegal.\n");
-        return -EMSGSIZE;
+    LastMessage = ReadChannel(FileSlot(file), channel, iov_iter_count(to), IsNonBlocking(iocb));
+    if(IS_ERR(LastMessage)){
+        msg_length = PTR_ERR(LastMessage);
+    }else{
+        msg_length = LastMessage->length;
+        if(copy_to_iter(LastMessage->msg, msg_length, to) != msg_length){
+            printk_ratelimited(KERN_ERR "Error in copying to user.\n");
+            msg_length = -EFAULT;
+        }
+        PutMessage(LastMessage);
     }
 
-    minor = iminor(file->f_inode);
+    if(start != 0){
+        trace_message_slot_read(FileSlot(file)->minor, channel, msg_length, ktime_get_ns() - start);
+    }
+    return msg_length;
+}
 
-    ret_val = GetNode(minor, channel, &WorkNode);
-    if (!ret_val){ //Node wasn't found.
-        ret_val = AddNode(minor, channel, &WorkNode);
-        if(ret_val){ //Error in making node.
-            return ret_val; 
+/*
+ * Writing or reading every entry of a batch in one kernel entry.
+ * Entries are handled in chunks that fit the stack. Every entry gets its own result, and the ioctl
+ * returns the number of entries that succeeded. Batches never wait on a single channel.
+ */
+static long ProcessBatch(struct file *file, unsigned long param, int write){
+    struct msg_slot_batch batch;
+    struct msg_slot_batch_entry chunk[BATCH_CHUNK_ENTRIES];
+    struct msg_slot_batch_entry __user *entries;
+    slot *WorkSlot = FileSlot(file);
+    long succeeded = 0;
+    unsigned int done, count, i;
+    message *NewMessage = NULL;
+    message *LastMessage = NULL;
+    ssize_t ret_val;
+
+    if(copy_from_user(&batch, (void __user*)param, sizeof(batch))){
+        return -EFAULT;
+    }
+    if(batch.count > MAX_BATCH_ENTRIES){
+        printk_ratelimited(KERN_ERR "Batch is too big.\n");
+        return -EINVAL;
+    }
+    entries = (struct msg_slot_batch_entry __user*)(unsigned long)batch.entries;
+
+    for(done = 0; done < batch.count; done += count){
+        count = min_t(unsigned int, batch.count - done, BATCH_CHUNK_ENTRIES);
+        if(copy_from_user(chunk, entries + done, count * sizeof(chunk[0]))){
+            return -EFAULT;
+        }
+
+        for(i = 0; i < count; i++){
+            void __user *buffer = (void __user*)(unsigned long)chunk[i].buffer;
+            long channel = (long)chunk[i].channel;
+
+            if(channel == 0){
+                ret_val = -EINVAL;
+            }else if(write){
+                NewMessage = NewSlotMessage(chunk[i].length);
+                if(IS_ERR(NewMessage)){
+                    ret_val = PTR_ERR(NewMessage);
+                }else if(copy_from_user(NewMessage->msg, buffer, NewMessage->length)){
+                    FreeMessage(NewMessage);
+                    ret_val = -EFAULT;
+                }else{
+                    ret_val = WriteChannel(WorkSlot, channel, NewMessage, TRUE);
+                }
+            }else{
+                LastMessage = ReadChannel(WorkSlot, channel, chunk[i].length, TRUE);
+                if(IS_ERR(LastMessage)){
+                    ret_val = PTR_ERR(LastMessage);
+                }else{
+                    ret_val = LastMessage->length;
+                    if(copy_to_user(buffer, LastMessage->msg, ret_val)){
+                        ret_val = -EFAULT;
+                    }
+                    PutMessage(LastMessage);
+                }
+            }
+
+            chunk[i].result = ret_val;
+            if(ret_val >= 0){
+                succeeded++;
+            }
+        }
+
+        if(copy_to_user(entries + done, chunk, count * sizeof(chunk[0]))){
+            return -EFAULT;
         }
     }
-    WorkNode->length = length;
 
-    if(copy_from_user((WorkNode->msg), buffer, length)){
+    return succeeded;
+}
+
+/*
+ * Custom ioctl command.
+ */
+static long device_ioctl(struct file *file,unsigned int ioctl_command_id,unsigned long ioctl_command_param){
+    if(file == NULL){
+        printk_ratelimited(KERN_ERR "Error in ioctl arguments");
         return -EINVAL;
     }
 
-    return WorkNode->length;
+    switch(ioctl_command_id){
+        case MSG_SLOT_CHANNEL:
+            if(ioctl_command_param == 0){
+                printk_ratelimited(KERN_ERR "0 id not supported");
+                return -EINVAL;
+            }
+            WRITE_ONCE(((file_state*)file->private_data)->channel, (long)ioctl_command_param);
+            return SUCCESS;
+
+        case MSG_SLOT_QUEUE_DEPTH:
+            if(FileChannel(file) == 0){
+                printk_ratelimited(KERN_ERR "Please set ioctl first.\n");
+                return -EINVAL;
+            }
+            return SetQueueDepth(file, ioctl_command_param);
+
+        case MSG_SLOT_RING_SETUP:
+        case MSG_SLOT_RING_WAIT:
+        case MSG_SLOT_RING_WAKE:
+            if(FileChannel(file) == 0){
+                printk_ratelimited(KERN_ERR "Please set ioctl first.\n");
+                return -EINVAL;
+            }
+            if(ioctl_command_id == MSG_SLOT_RING_SETUP){
+                return SetupSharedRing(file, ioctl_command_param);
+            }
+            if(ioctl_command_id == MSG_SLOT_RING_WAIT){
+                return WaitSharedRing(file, ioctl_command_param);
+            }
+            return WakeSharedRing(file);
+
+        case MSG_SLOT_WRITE_BATCH:
+            return ProcessBatch(file, ioctl_command_param, TRUE);
+
+        case MSG_SLOT_READ_BATCH:
+            return ProcessBatch(file, ioctl_command_param, FALSE);
+
+        case MSG_SLOT_DELETE_CHANNEL:
+            if(ioctl_command_param == 0){
+                printk_ratelimited(KERN_ERR "0 id not supported");
+                return -EINVAL;
+            }
+            return DeleteChannel(FileSlot(file), (long)ioctl_command_param);
+
+        case MSG_SLOT_WATCH:
+            return SetWatch(file, ioctl_command_param);
+
+        case MSG_SLOT_FETCH_DIRTY:
+            return FetchDirty(file, ioctl_command_param);
+
+        default:
+            printk_ratelimited(KERN_ERR "Not supported");
+            return -EINVAL;
+    }
 }
 
-static ssize_t device_read(struct file *file, char __user* buffer, size_t length,loff_t* offset){
-    int  minor, ret_val;
-    long channel;
-    node *FoundedNode = NULL;
+/*
+ * Pinning a node the file is about to wait on. Called under the file's poll lock.
+ * Pins of deleted nodes that nobody waits on anymore are dropped on the way, so the list only grows
+ * with channels that still exist.
+ */
+static int PinNode(file_state *State, node *WorkNode){
+    poll_pin *Pin = list_first_entry_or_null(&State->pins, poll_pin, list);
+    poll_pin *Next = NULL;
+    poll_pin *Found = NULL;
+
+    if(Pin != NULL && Pin->pinned == WorkNode){
+        return SUCCESS; //Usual case, the file waits on its channel again.
+    }
+
+    list_for_each_entry_safe(Pin, Next, &State->pins, list){
+        if(Pin->pinned == WorkNode){
+            Found = Pin;
+        }else if(READ_ONCE(Pin->pinned->deleted) && !waitqueue_active(&Pin->pinned->wq)){
+            list_del(&Pin->list);
+            PutNode(Pin->pinned);
+            kfree(Pin);
+        }
+    }
+    if(Found != NULL){
+        list_move(&Found->list, &State->pins);
+        return SUCCESS;
+    }
+
+    Found = (poll_pin*)kmalloc(sizeof(poll_pin), GFP_KERNEL);
+    if(Found == NULL){
+        return -ENOMEM;
+    }
+    kref_get(&WorkNode->refs);
+    Found->pinned = WorkNode;
+    list_add(&Found->list, &State->pins);
+    return SUCCESS;
+}
+
+/*
+ * Device poll function.
+ * Readable when a read wouldn't block, writable when a write wouldn't block.
+ * The channel is added if needed, so readers can wait for its first message.
+ * The file pins the node before waiting on it, so a deleted channel keeps its wait queue while poll(2),
+ * select(2) or epoll may still be on it.
+ */
+static __poll_t device_poll(struct file *file, poll_table *wait){
+    file_state *State = NULL;
+    node *WorkNode = NULL;
+    __poll_t mask = 0;
+
+    if(file == NULL || FileChannel(file) == 0){
+        return EPOLLERR;
+    }
+    State = (file_state*)file->private_data;
+
+    if(GetFileNode(file, &WorkNode)){
+        return EPOLLERR;
+    }
+
+    if(!poll_does_not_wait(wait)){
+        mutex_lock(&State->poll_lock);
+        if(PinNode(State, WorkNode)){
+            mutex_unlock(&State->poll_lock);
+            PutNode(WorkNode);
+            return EPOLLERR;
+        }
+        poll_wait(file, &WorkNode->wq, wait);
+        mutex_unlock(&State->poll_lock);
+    }
+
+    spin_lock(&WorkNode->lock);
+    if(WorkNode->ring != NULL){
+        if(WorkNode->count != 0){
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        if(WorkNode->count < WorkNode->depth){
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        }
+    }else{
+        if(rcu_access_pointer(WorkNode->last) != NULL){
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    spin_unlock(&WorkNode->lock);
+    PutNode(WorkNode);
+
+    return mask;
+}
+
+/*
+ * Every mapping of a shared ring holds a reference to its node, so the ring outlives a deleted channel.
+ */
+static void RingVmOpen(struct vm_area_struct *vma){
+    kref_get(&((node*)vma->vm_private_data)->refs);
+}
+
+static void RingVmClose(struct vm_area_struct *vma){
+    PutNode((node*)vma->vm_private_data);
+}
+
+static const struct vm_operations_struct RingVmOps = {
+        .open             = RingVmOpen,
+        .close            = RingVmClose
+};
+
+/*
+ * Device mmap function. Maps the shared ring of the file's channel.
+ */
+static int device_mmap(struct file *file, struct vm_area_struct *vma){
+    node *WorkNode = NULL;
+    int ret_val;
 
-    if(file == NULL || buffer == NULL){
-        printk(KERN_ERR "Error in device_read arguments.\n");
+    if(file == NULL || vma == NULL || FileChannel(file) == 0){
+        printk_ratelimited(KERN_ERR "Error in device_mmap arguments.\n");
         return -EINVAL;
     }
 
-    minor = iminor(file->f_inode);
-    channel = (long)(file->private_data);
-    if(channel  == 0){
-        printk(KERN_ERR "Please set ioctl first.\n");
+    WorkNode = GetSharedRingNode(file);
+    if(WorkNode == NULL){
+        printk_ratelimited(KERN_ERR "Please set up the ring first.\n");
         return -EINVAL;
     }
 
-    ret_val = GetNode(minor, channel, &FoundedNode);
-    if(!ret_val){
-        printk(KERN_ERR "Channel wasn't found.");
-        return -EWOULDBLOCK;
+    if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > WorkNode->shared_bytes){
+        PutNode(WorkNode);
+        return -EINVAL;
+    }
+    ret_val = remap_vmalloc_range(vma, WorkNode->shared, 0);
+    if(ret_val){
+        PutNode(WorkNode);
+        return ret_val;
     }
 
-    if(FoundedNode->length > length){
-        printk(KERN_ERR "Msg read too long.\n");
-        return -ENOSPC;
+    vma->vm_private_data = WorkNode; //The mapping keeps our reference.
+    vma->vm_ops = &RingVmOps;
+    return SUCCESS;
+}
+
+/*
+ * Summing the per CPU counters of a slot.
+ */
+static void SumCounters(slot *WorkSlot, counters *Total){
+    counters *CpuCounters = NULL;
+    int cpu;
+
+    memset(Total, 0, sizeof(counters));
+    for_each_possible_cpu(cpu){
+        CpuCounters = per_cpu_ptr(WorkSlot->counters, cpu);
+        Total->writes += CpuCounters->writes;
+        Total->reads += CpuCounters->reads;
+        Total->bytes_written += CpuCounters->bytes_written;
+        Total->bytes_read += CpuCounters->bytes_read;
+        Total->empty_reads += CpuCounters->empty_reads;
     }
+}
+
+/*
+ * debugfs "slots" file. One line per opened slot.
+ */
+static int slots_show(struct seq_file *seq, void *unused){
+    slot *WorkSlot = NULL;
+    unsigned long minor;
+    counters Total;
 
-    if(FoundedNode->length == 0){
-        printk(KERN_ERR "No massage found.\n");
-        return -EWOULDBLOCK;
+    seq_printf(seq, "minor channels bytes writes reads bytes_written bytes_read empty_reads\n");
+    xa_for_each(&Slots, minor, WorkSlot){
+        SumCounters(WorkSlot, &Total);
+        seq_printf(seq, "%u %ld %ld %lu %lu %lu %lu %lu\n", WorkSlot->minor, atomic_long_read(&WorkSlot->count),
+                   atomic_long_read(&WorkSlot->bytes), Total.writes, Total.reads, Total.bytes_written,
+                   Total.bytes_read, Total.empty_reads);
     }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(slots);
 
-    if(copy_to_user(buffer, (FoundedNode -> msg), FoundedNode->length)){
-        printk(KERN_ERR "Error in copying to user.\n");
-        return -EINVAL;
+/*
+ * debugfs "channels/<minor>" file. One line per channel of the slot.
+ * Nodes are freed after a grace period, so the walk is done under RCU.
+ */
+static int channels_show(struct seq_file *seq, void *unused){
+    slot *WorkSlot = (slot*)seq->private;
+    node *WorkNode = NULL;
+    unsigned long channel;
+
+    seq_printf(seq, "channel queued messages writes reads bytes_written bytes_read empty_reads\n");
+    rcu_read_lock();
+    xa_for_each(&WorkSlot->messages, channel, WorkNode){
+        seq_printf(seq, "%ld %u %u %ld %ld %ld %ld %ld\n", WorkNode->channel, READ_ONCE(WorkNode->depth),
+                   READ_ONCE(WorkNode->ring) != NULL ? READ_ONCE(WorkNode->count) : rcu_access_pointer(WorkNode->last) != NULL,
+                   atomic_long_read(&WorkNode->writes), atomic_long_read(&WorkNode->reads),
+                   atomic_long_read(&WorkNode->bytes_written), atomic_long_read(&WorkNode->bytes_read),
+                   atomic_long_read(&WorkNode->empty_reads));
+    }
+    rcu_read_unlock();
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(channels);
+
+/*
+ * Finding the slot of a minor, creating it on the first open.
+ */
+static slot *GetSlot(unsigned int minor){
+    slot *NewSlot = xa_load(&Slots, minor);
+    char name[16];
+    int ret_val;
+
+    if(NewSlot != NULL){
+        return NewSlot;
+    }
+
+    NewSlot = (slot*)kzalloc(sizeof(slot), GFP_KERNEL);
+    if(NewSlot == NULL){
+        return ERR_PTR(-ENOMEM);
+    }
+    NewSlot->counters = alloc_percpu(counters);
+    if(NewSlot->counters == NULL){
+        kfree(NewSlot);
+        return ERR_PTR(-ENOMEM);
     }
+    NewSlot->minor = minor;
+    xa_init(&NewSlot->messages);
+    atomic_long_set(&NewSlot->count, 0);
+    atomic_long_set(&NewSlot->bytes, 0);
+    INIT_LIST_HEAD(&NewSlot->lru);
+    spin_lock_init(&NewSlot->lru_lock);
+    xa_init(&NewSlot->watches);
+    mutex_init(&NewSlot->watch_lock);
 
-    return FoundedNode->length;
+    ret_val = xa_insert(&Slots, minor, NewSlot, GFP_KERNEL);
+    if(ret_val){
+        free_percpu(NewSlot->counters);
+        kfree(NewSlot);
+        return ret_val == -EBUSY ? xa_load(&Slots, minor) : ERR_PTR(ret_val); //Lost the race.
+    }
+
+    snprintf(name, sizeof(name), "%u", minor);
+    debugfs_create_file(name, 0444, DebugChannels, NewSlot, &channels_fops);
+    return NewSlot;
 }
 
 /*
  * Device open function.
  */
 static int device_open(struct inode *inode,struct file *file){
+    file_state *State = NULL;
+    slot *WorkSlot = NULL;
+
     if(file == NULL || inode == NULL){
-        printk(KERN_ERR "Error in device_open arguments.\n");
+        printk_ratelimited(KERN_ERR "Error in device_open arguments.\n");
         return -EINVAL;
     }
-    file->private_data = (void*)0;
+
+    WorkSlot = GetSlot(iminor(inode));
+    if(IS_ERR(WorkSlot)){
+        return PTR_ERR(WorkSlot);
+    }
+
+    State = (file_state*)kmalloc(sizeof(file_state), GFP_KERNEL);
+    if(State == NULL){
+        return -ENOMEM;
+    }
+    State->owner = WorkSlot;
+    State->channel = 0;
+    State->watches = NULL;
+    State->fasync = NULL;
+    INIT_LIST_HEAD(&State->pins);
+    mutex_init(&State->poll_lock);
+    file->private_data = State;
+    return SUCCESS;
+}
+
+/*
+ * Device release function. The fasync entry is already gone, so only the watch and the pins are left.
+ * Poll entries hold the file, so nobody waits on the pinned nodes anymore.
+ */
+static int device_release(struct inode *inode,struct file *file){
+    file_state *State = (file_state*)file->private_data;
+    watch *Watch = State->watches;
+    poll_pin *Pin = NULL;
+    poll_pin *Next = NULL;
+
+    if(Watch != NULL){
+        mutex_lock(&State->owner->watch_lock);
+        UnlinkWatch(State->owner, Watch, Watch->count);
+        mutex_unlock(&State->owner->watch_lock);
+        synchronize_rcu(); //Writers may still be signalling it.
+        FreeWatch(Watch);
+    }
+    list_for_each_entry_safe(Pin, Next, &State->pins, list){
+        PutNode(Pin->pinned);
+        kfree(Pin);
+    }
+    mutex_destroy(&State->poll_lock);
+    kfree(State);
     return SUCCESS;
 }
 
+/*
+ * Device fasync function. SIGIO is sent when a watched channel becomes dirty.
+ */
+static int device_fasync(int fd, struct file *file, int on){
+    return fasync_helper(fd, file, on, &((file_state*)file->private_data)->fasync);
+}
+
 
 /*
  * File operation struct.
  */
 struct file_operations Fops = {
         .owner            = THIS_MODULE,
-        .write            = device_write,
+        .write_iter       = device_write_iter,
         .open             = device_open,
-        .read             = device_read,
+        .release          = device_release,
+        .read_iter        = device_read_iter,
+        .poll             = device_poll,
+        .mmap             = device_mmap,
+        .fasync           = device_fasync,
         .unlocked_ioctl   = device_ioctl
 };
 
 /*
- * Init counter array.
+ * Destroy node and message caches. Every object must be freed, including those waiting for RCU.
+ */
+static void CachesDestroy(void){
+    int i;
+    for(i = 0; i <= MESSAGE_CLASSES; i++){
+        kmem_cache_destroy(MessageCaches[i]);
+        MessageCaches[i] = NULL;
+    }
+    kmem_cache_destroy(NodeCache);
+    NodeCache = NULL;
+}
+
+/*
+ * Init node and message caches.
+ * Nodes are aligned to cache lines since writers of different channels take their locks concurrently.
  */
-static void CounterInit(void){
+static int CachesInit(void){
     int i;
-    for(i=0; i <MAX_SLOTS_NUMBER; i++){
-        CounterArray[i] = 0;
+
+    NodeCache = KMEM_CACHE(slot_node, SLAB_HWCACHE_ALIGN);
+    if(NodeCache == NULL){
+        return -ENOMEM;
+    }
+
+    for(i = 0; i <= MESSAGE_CLASSES; i++){
+        unsigned int bytes = sizeof(message) + (i < MESSAGE_CLASSES ? MessageClassBytes[i] : 0);
+        MessageCaches[i] = kmem_cache_create(MessageCacheNames[i], bytes, 0, 0, NULL);
+        if(MessageCaches[i] == NULL){
+            CachesDestroy();
+            return -ENOMEM;
+        }
     }
+    return SUCCESS;
 }
 
 /*
@@ -229,31 +1785,68 @@ static void CounterInit(void){
  */
 static int __init simple_init(void){
     int rc;
-    rc = register_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME, &Fops);
+    if(max_msg_bytes == 0 || max_msg_bytes > MAX_MSG_LIMIT){
+        printk(KERN_ERR "max_msg_bytes must be between 1 and %d.\n", MAX_MSG_LIMIT);
+        return -EINVAL;
+    }
+    if(max_slots == 0 || max_slots > MINORMASK + 1){
+        printk(KERN_ERR "max_slots must be between 1 and %d.\n", MINORMASK + 1);
+        return -EINVAL;
+    }
+    rc = CachesInit();
+    if(rc){
+        printk(KERN_ERR "Can't create message caches.\n");
+        return rc;
+    }
+
+    if(major != 0){
+        SlotDevice = MKDEV(major, 0);
+        rc = register_chrdev_region(SlotDevice, max_slots, DEVICE_RANGE_NAME);
+    }else{
+        rc = alloc_chrdev_region(&SlotDevice, 0, max_slots, DEVICE_RANGE_NAME);
+    }
+    if(rc < 0){
+        printk(KERN_ERR "Registration failed for %d.\n",  major);
+        CachesDestroy();
+        return rc;
+    }
+
+    DebugRoot = debugfs_create_dir(DEVICE_RANGE_NAME, NULL); //Statistics are optional, so errors are ignored.
+    DebugChannels = debugfs_create_dir("channels", DebugRoot);
+    debugfs_create_file("slots", 0444, DebugRoot, NULL, &slots_fops);
+
+    cdev_init(&SlotCdev, &Fops);
+    SlotCdev.owner = THIS_MODULE;
+    rc = cdev_add(&SlotCdev, SlotDevice, max_slots);
     if(rc < 0){
-        printk(KERN_ERR "Registration failed for %d.\n",  MAJOR_NUM);
+        printk(KERN_ERR "Registration failed for %d.\n",  MAJOR(SlotDevice));
+        debugfs_remove_recursive(DebugRoot);
+        unregister_chrdev_region(SlotDevice, max_slots);
+        CachesDestroy();
         return rc;
     }
-    printk(KERN_INFO "Registration succeeded for %d.\n",  MAJOR_NUM);
-    CounterInit();
+    printk(KERN_INFO "Registration succeeded for %d.\n",  MAJOR(SlotDevice));
     return SUCCESS;
 }
 
 /*
- * Free list allocation.
+ * Free channel allocation.
  */
 static void ListCleanUp(void){
     node *WorkingNode = NULL;
-    node *tmp = NULL;
-    int i;
-    for(i = 0; i < MAX_MSG_BYTES; i++){
-        WorkingNode = messages[i];
-        while(WorkingNode != NULL){
-            tmp = WorkingNode;
-            WorkingNode = WorkingNode->next;
-            kfree(tmp);
+    slot *WorkSlot = NULL;
+    unsigned long channel, minor;
+    xa_for_each(&Slots, minor, WorkSlot){
+        xa_for_each(&WorkSlot->messages, channel, WorkingNode){
+            DeleteNode(WorkingNode); //No files are open, so this frees the node.
         }
+        xa_destroy(&WorkSlot->messages);
+        xa_destroy(&WorkSlot->watches); //Emptied when the watching files were released.
+        mutex_destroy(&WorkSlot->watch_lock);
+        free_percpu(WorkSlot->counters);
+        kfree(WorkSlot);
     }
+    xa_destroy(&Slots);
 }
 
 /*
@@ -261,9 +1854,13 @@ static void ListCleanUp(void){
  */
 static void __exit simple_cleanup(void){
     //Free slots.
-    unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);
+    cdev_del(&SlotCdev);
+    debugfs_remove_recursive(DebugRoot); //Waits for readers of the statistics.
+    unregister_chrdev_region(SlotDevice, max_slots);
     ListCleanUp();
+    rcu_barrier(); //Wait for nodes and messages still queued by PutNode() and PutMessage().
+    CachesDestroy();
 }
 
 module_init(simple_init);
-module_exit(simple_cleanup);
\ No newline at end of file
+module_exit(simple_cleanup);
@@ -2,15 +2,96 @@
 #define MESSAGE_SLOT
 
 #include <linux/ioctl.h>
-#define MAJOR_NUM 240
+#include <linux/types.h>
+#define MAJOR_NUM 240 //ioctl magic, and the major when the module is loaded with major=240.
 #define MSG_SLOT_CHANNEL _IOW(MAJOR_NUM, 0, unsigned long)
+#define MSG_SLOT_QUEUE_DEPTH _IOW(MAJOR_NUM, 1, unsigned long)
+#define MSG_SLOT_RING_SETUP _IOW(MAJOR_NUM, 2, unsigned long)
+#define MSG_SLOT_RING_WAIT _IOW(MAJOR_NUM, 3, unsigned long)
+#define MSG_SLOT_RING_WAKE _IO(MAJOR_NUM, 4)
+#define MSG_SLOT_WRITE_BATCH _IOW(MAJOR_NUM, 5, struct msg_slot_batch)
+#define MSG_SLOT_READ_BATCH _IOW(MAJOR_NUM, 6, struct msg_slot_batch)
+#define MSG_SLOT_DELETE_CHANNEL _IOW(MAJOR_NUM, 7, unsigned long)
+#define MSG_SLOT_WATCH _IOW(MAJOR_NUM, 8, struct msg_slot_watch)
+#define MSG_SLOT_FETCH_DIRTY _IOW(MAJOR_NUM, 9, struct msg_slot_dirty)
 #define MAX_MSG_BYTES 128
+#define MAX_MSG_LIMIT 1048576
+#define MESSAGE_CLASS_BYTES {16, 64, 128, 512, 2048} //Inline payload of the message size classes, shared with the engine.
 #define MAX_SLOTS_NUMBER 256
 #define SUCCESS 0
 #define FAIL -1
 #define CHANNEL_NUMBER 1048576
+#define MAX_QUEUE_DEPTH 4096
+#define MAX_RING_ENTRIES 65536
+#define RING_READABLE 1
+#define RING_WRITABLE 2
+#define MAX_BATCH_ENTRIES 4096
+#define BATCH_CHUNK_ENTRIES 16
+#define MAX_WATCH_CHANNELS 65536
 #define DEVICE_RANGE_NAME "message_slot"
+#define MAX_MSG_PARAM "/sys/module/message_slot/parameters/max_msg_bytes"
 #define TRUE 1
 #define FALSE 0
 
+/*
+ * Shared ring of a channel, mapped by mmap() after MSG_SLOT_RING_SETUP.
+ * One producer and one consumer exchange messages through head and tail, and only call
+ * MSG_SLOT_RING_WAIT/MSG_SLOT_RING_WAKE when the ring is full or empty.
+ * Fields that each side writes live in their own cache line.
+ */
+struct msg_slot_ring_entry{
+    __u32 length;
+    char msg[MAX_MSG_BYTES];
+};
+
+struct msg_slot_ring{
+    __u32 size;                                  //Number of entries, power of 2.
+    __u32 head __attribute__((aligned(64)));     //Next entry the producer fills.
+    __u32 reader_waiting;
+    __u32 tail __attribute__((aligned(64)));     //Next entry the consumer takes.
+    __u32 writer_waiting;
+    struct msg_slot_ring_entry entries[] __attribute__((aligned(64)));
+};
+
+/*
+ * Batch of messages for MSG_SLOT_WRITE_BATCH/MSG_SLOT_READ_BATCH, each on its own channel.
+ * length is the message length for writes and the buffer size for reads.
+ * result is set to the bytes written or read, or to a negative error.
+ */
+struct msg_slot_batch_entry{
+    __u64 channel;
+    __u64 buffer;
+    __u32 length;
+    __s32 result;
+};
+
+struct msg_slot_batch{
+    __u64 entries;
+    __u32 count;
+    __u32 reserved;
+};
+
+/*
+ * Channels watched by a file, for MSG_SLOT_WATCH. Bit i of the file's dirty bitmap belongs to channels[i].
+ * A write to a watched channel sets its bit, and when nothing was dirty since the last fetch it signals
+ * the eventfd (unless eventfd is -1) and sends SIGIO to the file's fasync owner.
+ * A new watch replaces the old one, and count 0 removes it.
+ */
+struct msg_slot_watch{
+    __u64 channels;     //Array of count channel ids.
+    __u32 count;
+    __s32 eventfd;
+};
+
+/*
+ * Dirty bitmap for MSG_SLOT_FETCH_DIRTY, copied and cleared in one call.
+ * bitmap holds words 64 bit words, at least (count + 63) / 64 of the watch.
+ * The ioctl returns the number of dirty channels.
+ */
+struct msg_slot_dirty{
+    __u64 bitmap;
+    __u32 words;
+    __u32 reserved;
+};
+
 #endif
\ No newline at end of file
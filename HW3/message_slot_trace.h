@@ -0,0 +1,48 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM message_slot
+
+#if !defined(_MESSAGE_SLOT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MESSAGE_SLOT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Every read and write of a slot, with its result and how long it took in the driver.
+ * For example, "perf trace -e message_slot:*" or a hist trigger on duration_ns gives latency histograms.
+ */
+DECLARE_EVENT_CLASS(message_slot_io,
+    TP_PROTO(unsigned int minor, long channel, ssize_t result, u64 duration_ns),
+    TP_ARGS(minor, channel, result, duration_ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(long, channel)
+        __field(ssize_t, result)
+        __field(u64, duration_ns)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->channel = channel;
+        __entry->result = result;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("minor=%u channel=%ld result=%zd duration_ns=%llu", __entry->minor, __entry->channel,
+              __entry->result, (unsigned long long)__entry->duration_ns)
+);
+
+DEFINE_EVENT(message_slot_io, message_slot_write,
+    TP_PROTO(unsigned int minor, long channel, ssize_t result, u64 duration_ns),
+    TP_ARGS(minor, channel, result, duration_ns)
+);
+
+DEFINE_EVENT(message_slot_io, message_slot_read,
+    TP_PROTO(unsigned int minor, long channel, ssize_t result, u64 duration_ns),
+    TP_ARGS(minor, channel, result, duration_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE message_slot_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,140 @@
+#define _POSIX_C_SOURCE 200809L
+#include "message_slot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Multi threaded stress test for the message slot device.
+ * Every thread writes and reads its own channel, or all threads share channel 1 when "shared" is given.
+ * Reads check that the message is one that was written, so torn messages are reported.
+ *
+ * Usage: stress <device> <threads> <seconds> [shared]
+ */
+
+#define STRESS_MSG_BYTES 64
+
+typedef struct stress_thread{
+    pthread_t thread;
+    unsigned long channel;
+    long ops;
+    long torn;
+}stress_thread;
+
+static char* FilePath;
+static volatile int Running = 1;
+
+/*
+ * Messages are one repeated byte, so a torn read shows up as a mix of bytes.
+ */
+static int MessageIsWhole(const char* Message, int length){
+    int i;
+    for(i = 1; i < length; i++){
+        if(Message[i] != Message[0]){
+            return 0;
+        }
+    }
+    return length == STRESS_MSG_BYTES;
+}
+
+static void* StressLoop(void* arg){
+    stress_thread* self = (stress_thread*)arg;
+    char Message[MAX_MSG_BYTES];
+    char Read[MAX_MSG_BYTES];
+    int file_desc, ret_val;
+    long i = 0, ops = 0, torn = 0;
+
+    file_desc = open(FilePath, O_RDWR);
+    if(file_desc < 0){
+        perror("Error in opening file");
+        exit(1);
+    }
+
+    if(ioctl(file_desc, MSG_SLOT_CHANNEL, self->channel) < 0){
+        perror("Error in opening device");
+        exit(1);
+    }
+
+    while(Running){
+        memset(Message, 'a' + (i++ % 26), STRESS_MSG_BYTES);
+        if(write(file_desc, Message, STRESS_MSG_BYTES) != STRESS_MSG_BYTES){
+            perror("Error in writing message");
+            exit(1);
+        }
+
+        ret_val = read(file_desc, Read, MAX_MSG_BYTES);
+        if(ret_val < 0 && errno != EWOULDBLOCK){
+            perror("Error in reading massage");
+            exit(1);
+        }
+        if(ret_val >= 0 && !MessageIsWhole(Read, ret_val)){
+            torn++;
+        }
+        ops += 2;
+    }
+
+    //Counters are kept local and stored once, so neighbouring threads don't share a cache line while running.
+    self->ops = ops;
+    self->torn = torn;
+    close(file_desc);
+    return NULL;
+}
+
+int main(int argc, char *argv[]){
+    stress_thread* Threads;
+    int NumberOfThreads, Seconds, Shared, i;
+    long TotalOps = 0, TotalTorn = 0;
+    struct timespec Start, End;
+    double Elapsed;
+
+    if(argc != 4 && argc != 5){
+        fprintf(stderr, "Usage: %s <device> <threads> <seconds> [shared]\n", argv[0]);
+        exit(1);
+    }
+
+    FilePath = argv[1];
+    NumberOfThreads = atoi(argv[2]);
+    Seconds = atoi(argv[3]);
+    Shared = argc == 5 && strcmp(argv[4], "shared") == 0;
+    if(NumberOfThreads <= 0 || Seconds <= 0){
+        fprintf(stderr, "Error in stress arguments.\n");
+        exit(1);
+    }
+
+    Threads = calloc(NumberOfThreads, sizeof(stress_thread));
+    if(Threads == NULL){
+        fprintf(stderr, "Error in allocating threads.\n");
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    for(i = 0; i < NumberOfThreads; i++){
+        Threads[i].channel = Shared ? 1 : i + 1;
+        if(pthread_create(&Threads[i].thread, NULL, StressLoop, &Threads[i])){
+            fprintf(stderr, "Error in creating thread.\n");
+            exit(1);
+        }
+    }
+
+    sleep(Seconds);
+    Running = 0;
+
+    for(i = 0; i < NumberOfThreads; i++){
+        pthread_join(Threads[i].thread, NULL);
+        TotalOps += Threads[i].ops;
+        TotalTorn += Threads[i].torn;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    Elapsed = (End.tv_sec - Start.tv_sec) + (End.tv_nsec - Start.tv_nsec) / 1e9;
+
+    printf("%d threads, %s channels: %.0f ops/sec, %ld torn reads\n", NumberOfThreads,
+           Shared ? "shared" : "private", TotalOps / Elapsed, TotalTorn);
+    free(Threads);
+    return TotalTorn != 0;
+}
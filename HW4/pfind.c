@@ -1,416 +1,2822 @@
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <signal.h>
+#include <poll.h>
+#include <limits.h>
+#include <regex.h>
 #include <zconf.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#if defined(SYS_getdents64) && defined(SYS_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_URING
+#endif
+#endif
 
 #define True 1
 #define False 0
 #define CONTINUE_MSG "Directory %s: Permission denied.\n"
 #define EXIT_MSG "Done searching, found %d files\n"
+#define INITIAL_DEQUE_SIZE 256
+#define STEAL_ROUNDS 2
+#define DIRENT_BUFFER_BYTES (256 * 1024)
+#define PATH_CHUNK_BYTES (64 * 1024)
+#define OUTPUT_BUFFER_BYTES (64 * 1024)
+#define DEFAULT_URING_DEPTH 64
+#define MAX_URING_DEPTH 4096
+#define URING_STAT (1ULL << 63)
+#define INDEX_MAGIC "PFINDIX1"
+#define INDEX_BLOCK_DIRECTORIES 64
+#define INDEX_BUFFER_BYTES (64 * 1024)
+#define INDEX_MSG "Indexed %lld directories and %lld entries of %s\n"
+#define REFRESH_MSG "Refreshed %lld directories and %lld entries of %s, %lld directories were read again\n"
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define WATCH_BUFFER_BYTES (64 * 1024)
+#define INITIAL_MATCHES_SIZE 1024
+#define USAGE_MSG "Usage: pfind [--sorted] [--uring[=depth]] [--watch] [-e literal]... [-g glob]... [-r regex]... <root> [<pattern>] <threads>\n" \
+                  "       pfind --build-index=<index> <root> <threads>\n" \
+                  "       pfind --refresh=<index> <threads>\n" \
+                  "       pfind --index=<index> [--sorted] [-e literal]... [-g glob]... [-r regex]... [<pattern>] <threads>\n"
+#define AC_ROOT 0
 
 /*
  * -----Structs-------
  */
+/*
+ * Queued directory: its name and its parent, whose path is rebuilt when the directory is scanned.
+ * A node lives as long as it is queued or scanned, or any of its children lives.
+ */
 typedef struct node
 {
-    char directory[PATH_MAX];
-    struct node *next;
+    struct node *parent;    //NULL for the root.
+    int refs;               //Its own scan, and one per live child.
+    unsigned short length;
+    char name[];
 }DirectoryNode;
 
-typedef struct queue{
-    int length;
-    DirectoryNode *head;
-    DirectoryNode *tail;
-}Queue;
+/*
+ * Chunk of nodes. Every thread carves its nodes from its current chunk, and a chunk is freed in one piece
+ * when all of its nodes are released and no thread allocates from it anymore.
+ * Chunks are aligned to their size, so a node finds its chunk from its own address.
+ */
+typedef struct path_chunk
+{
+    long live;      //Live nodes, plus one while a thread allocates from the chunk.
+    char data[] __attribute__((aligned(16)));
+}PathChunk;
+
+/*
+ * Array of a deque. Arrays replaced by a bigger one are kept until the end, thieves may still read them.
+ */
+typedef struct deque_array
+{
+    long size;
+    struct deque_array *previous;
+    DirectoryNode *items[];
+}DequeArray;
+
+/*
+ * Matches of a thread. Unsorted output is written with one write() whenever the buffer fills.
+ * Sorted output grows until the end of the search, then all threads' matches are sorted together.
+ */
+typedef struct output
+{
+    char *buffer;
+    size_t length;
+    size_t size;
+    long matches;
+}OutputBuffer;
+
+/*
+ * Growing buffer. Scanning threads fill one each with IndexRecords, and for --watch with the directories
+ * they watch and the matches they found.
+ */
+typedef struct index_buffer
+{
+    char *buffer;
+    size_t length;
+    size_t size;
+    size_t open;                //Offset of the record entries are added to.
+    long long directories;
+    long long entries;
+    long long reused;           //Directories --refresh took from the old index.
+}IndexBuffer;
+
+/*
+ * Chase-Lev work stealing deque, with the rest of the state of its thread.
+ * The owner pushes and pops directories at the bottom without locking,
+ * other threads steal the oldest directories from the top with one compare and swap.
+ * top and bottom are on their own cache lines, since thieves write top while the owner writes bottom.
+ */
+typedef struct deque
+{
+    long top __attribute__((aligned(64)));
+    long bottom __attribute__((aligned(64)));
+    DequeArray *array;
+    unsigned long seed;
+    PathChunk *chunk;       //Where the owner allocates nodes.
+    size_t chunk_used;
+    OutputBuffer output;
+    IndexBuffer records;    //Directories scanned for --build-index and --refresh.
+    IndexBuffer watches;    //For --watch, watch descriptors and their directories.
+    IndexBuffer found;
+}Deque;
+
+/*
+ * Entry returned by getdents64, parsed in place in the buffer.
+ */
+typedef struct linux_dirent64
+{
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+}LinuxDirent;
+
+/*
+ * Aho-Corasick automaton of the literal patterns, with the failure links already folded into the
+ * transitions, so matching a name costs one table lookup per byte.
+ */
+typedef struct aho_corasick
+{
+    int states;
+    int *next;      //states * 256 transitions.
+    char *accept;   //Whether a literal ends in the state, or in one of its suffixes.
+}AhoCorasick;
+
+/*
+ * Start of an index file, see WriteIndex.
+ */
+typedef struct index_header
+{
+    char magic[8];
+    unsigned long long bytes;
+    unsigned long long directories;
+    unsigned long long entries;
+    unsigned long long blocks;
+    unsigned long long blocks_offset;   //Of the block offsets, at the end of the file.
+    unsigned int root_length;
+    unsigned int reserved;
+    char root[];
+}IndexHeader;
+
+/*
+ * Scanned directory in the buffer of its thread: its path, then count entries,
+ * each a byte that is 1 for directories and the name.
+ */
+typedef struct index_record
+{
+    long long mtime;
+    unsigned int path_length;
+    unsigned int count;
+    unsigned int bytes;         //Of the entries.
+    char path[];
+}IndexRecord;
+
+/*
+ * Position in a block of an index, with the directory and entry read last.
+ */
+typedef struct index_cursor
+{
+    const unsigned char *at;
+    const unsigned char *end;
+    const unsigned char *entries_end;   //Of the current directory.
+    char path[PATH_MAX];
+    size_t path_length;
+    long long mtime;
+    unsigned long long left;    //Entries of the directory not read yet.
+    int first;
+    int first_entry;
+    char name[NAME_MAX + 1];
+    size_t name_length;
+    int is_directory;
+}IndexCursor;
+
+/*
+ * What pfind does with an index.
+ */
+enum index_mode
+{
+    NO_INDEX,
+    INDEX_BUILD,
+    INDEX_REFRESH,
+    INDEX_QUERY
+};
+
+#ifdef HAVE_URING
+/*
+ * Directory whose open is in flight on the ring of its thread.
+ */
+typedef struct uring_slot
+{
+    DirectoryNode *node;
+    int result;             //Of the openat, a file descriptor or -errno.
+    size_t prefix;
+    char directory[PATH_MAX];
+}UringSlot;
+
+/*
+ * io_uring of one thread, set up with raw system calls. Opens of queued directories and stats of entries
+ * without d_type go through it, reading directories stays a getdents64 call, which io_uring doesn't have.
+ */
+typedef struct uring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_bytes, cq_bytes, sqes_bytes;
+    unsigned pending;       //Queued entries the kernel doesn't have yet.
+    UringSlot *slots;
+    int *free_slots;
+    int free_count;
+    int *done_slots;        //Slots whose open completed, not scanned yet.
+    int done_count;
+    LinuxDirent **stat_entries;
+    struct statx *stats;
+    int *stat_results;
+    int stat_count;
+    int stats_pending;
+}Uring;
+#endif
 
 /*
  * Locks and conditionals.
  */
-pthread_mutex_t queue_lock, counter_lock, dead_thread_lock, sleep_thread_lock, thread_lock, start_all_lock;
-pthread_cond_t queue_not_empty, start_search;
+pthread_mutex_t park_lock, output_lock;
+pthread_cond_t work_available;
 
 /*
  * Fields.
  */
 int NumberOfThreads;
 pthread_t *ThreadList;
-char* Pattern;
-static Queue WorkingQueue = {0, NULL, NULL};
+char *ThreadStarted;
+Deque *Deques;
+static __thread long ThreadIndex;
+char **Literals;
+int LiteralCount;
+size_t LiteralLength;       //Of Literals[0], when it is the only one.
+char **RegexSources;        //Globs, already translated, then regexes.
+int RegexCount;
+regex_t *Regexes;           //RegexCount compiled copies per thread.
+AhoCorasick Automaton;
+int MatchAll;
+int (*FindLiteral)(const char *name, size_t length);
+int Sorted;
+int UringDepth;             //0 without --uring.
+enum index_mode IndexMode;
+char *IndexFile;
+char *IndexRoot;            //Root of the search, and of the index being written.
+IndexHeader *Index;         //Mapped for --index, and the old index for --refresh.
+size_t IndexBytes;
+long NextBlock;             //Of the index, for the next querying thread.
+int Watching;
+int WatchFd;                //inotify instance of --watch, -1 without it.
+int Rescanning;             //Scanning directories --watch found after the first search.
+int WatchesExhausted;
+char **WatchPaths;          //Directory of every watch descriptor.
+int WatchPathsSize;
+char **Matches;             //Hash set of the matches --watch knows of.
+size_t MatchesSize;
+size_t MatchesUsed;         //Live and removed slots.
+size_t MatchesLive;
+int Resyncing;              //Scanning the whole tree again after inotify lost events.
+char **StaleMatches;        //Matches and watches from before the lost events, until the scan replaces them.
+size_t StaleMatchesSize;
+char **StaleWatchPaths;
+int StaleWatchPathsSize;
+volatile sig_atomic_t Stopping;
 int PatternCounter;
 int SleepThreads;
+int WakeupsPending;
+long Outstanding;           //Directories queued or being scanned. The search is over when it drops to 0.
+int SearchDone;
 int ThreadErrorsCounter;
-int TotalOpened;
 
 /*
- * Check if we can search in this directory.
+ * Check if we can search in this directory.
+ */
+int DirectorySearchable(char *path)
+{
+    DIR *dir = opendir(path);
+    if(!dir)
+    {
+        return 0;
+    }
+    else
+    {
+        closedir(dir);
+        return 1;
+    }
+}
+
+static DequeArray* NewDequeArray(long size)
+{
+    DequeArray *array = malloc(sizeof(DequeArray) + size * sizeof(DirectoryNode*));
+    if(array == NULL)
+    {
+        fprintf(stderr, "Error in allocating memory for deque.");
+        exit(1);
+    }
+    array->size = size;
+    array->previous = NULL;
+    return array;
+}
+
+static DirectoryNode* DequeItem(DequeArray *array, long i)
+{
+    return __atomic_load_n(&array->items[i & (array->size - 1)], __ATOMIC_RELAXED);
+}
+
+/*
+ * Doubling the array of a full deque. Only the owner calls it.
+ */
+static DequeArray* GrowDeque(Deque *deque, DequeArray *array, long top, long bottom)
+{
+    DequeArray *bigger = NewDequeArray(array->size * 2);
+    for(long i = top; i < bottom; i++)
+    {
+        bigger->items[i & (bigger->size - 1)] = DequeItem(array, i);
+    }
+    bigger->previous = array;
+    __atomic_store_n(&deque->array, bigger, __ATOMIC_RELEASE);
+    return bigger;
+}
+
+static void PushDirectory(Deque *deque, DirectoryNode *node)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    DequeArray *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+    if(bottom - top > array->size - 1)
+    {
+        array = GrowDeque(deque, array, top, bottom);
+    }
+    __atomic_store_n(&array->items[bottom & (array->size - 1)], node, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Owner side. Newest directory first, so a thread walks its own subtree depth first.
+ */
+static DirectoryNode* PopDirectory(Deque *deque)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    DequeArray *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    DirectoryNode *node = NULL;
+    long top;
+
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if(top <= bottom)
+    {
+        node = DequeItem(array, bottom);
+        if(top == bottom)
+        {
+            //Last directory, thieves may race us for it.
+            if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, False, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            {
+                node = NULL;
+            }
+            __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return node;
+}
+
+/*
+ * Thief side. Oldest directory first, which is usually the biggest subtree.
+ * Returns NULL when the deque is empty or another thread won the directory.
+ */
+static DirectoryNode* StealDirectory(Deque *deque)
+{
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    DirectoryNode *node;
+
+    if(top >= bottom)
+    {
+        return NULL;
+    }
+    node = DequeItem(__atomic_load_n(&deque->array, __ATOMIC_ACQUIRE), top);
+    if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, False, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return NULL;
+    }
+    return node;
+}
+
+static int DequeEmpty(Deque *deque)
+{
+    return __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST) >= __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Return true if no thread has queued directories.
+ */
+int IsEmpty()
+{
+    for(int i=0; i<NumberOfThreads; i++)
+    {
+        if(!DequeEmpty(&Deques[i]))
+        {
+            return False;
+        }
+    }
+    return True;
+}
+
+/*
+ * Waking one sleeping thread. Called with park_lock held.
+ * The thread is counted as awake right away, so the next directory queued wakes another one.
+ */
+void Wakeup()
+{
+    if(SleepThreads > 0)
+    {
+        __atomic_store_n(&SleepThreads, SleepThreads - 1, __ATOMIC_RELAXED);
+        WakeupsPending++;
+        pthread_cond_signal(&work_available);
+    }
+}
+
+static PathChunk* ChunkOf(DirectoryNode *node)
+{
+    return (PathChunk *)((unsigned long)node & ~(unsigned long)(PATH_CHUNK_BYTES - 1));
+}
+
+static void ReleaseChunk(PathChunk *chunk)
+{
+    if(__atomic_sub_fetch(&chunk->live, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(chunk);
+    }
+}
+
+/*
+ * Carving a node from the chunk of this thread. Nodes of other threads may still live in a full chunk,
+ * so the thread only drops its own reference when it moves to a new chunk.
+ */
+static DirectoryNode* AllocateNode(size_t length)
+{
+    Deque *self = &Deques[ThreadIndex];
+    size_t bytes = (sizeof(DirectoryNode) + length + 1 + 7) & ~(size_t)7;
+
+    if(self->chunk == NULL || self->chunk_used + bytes > PATH_CHUNK_BYTES)
+    {
+        PathChunk *chunk = aligned_alloc(PATH_CHUNK_BYTES, PATH_CHUNK_BYTES);
+        if(chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->live = 1;
+        if(self->chunk != NULL)
+        {
+            ReleaseChunk(self->chunk);
+        }
+        self->chunk = chunk;
+        self->chunk_used = offsetof(PathChunk, data);
+    }
+
+    DirectoryNode *node = (DirectoryNode *)((char *)self->chunk + self->chunk_used);
+    self->chunk_used += bytes;
+    __atomic_add_fetch(&self->chunk->live, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+/*
+ * Dropping a reference to a node. A node without references releases its parent too.
+ */
+void ReleaseNode(DirectoryNode *node)
+{
+    while(node != NULL && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        DirectoryNode *parent = node->parent;
+        ReleaseChunk(ChunkOf(node));
+        node = parent;
+    }
+}
+
+/*
+ * Writing the path of a node into path. Returns its length, or 0 when it doesn't fit.
+ */
+size_t BuildPath(DirectoryNode *node, char *path)
+{
+    size_t length = 0;
+    DirectoryNode *chain[PATH_MAX / 2];
+    int depth = 0;
+
+    for(; node != NULL; node = node->parent)
+    {
+        if(depth == PATH_MAX / 2)
+        {
+            return 0;
+        }
+        chain[depth++] = node;
+    }
+
+    while(depth-- > 0)
+    {
+        node = chain[depth];
+        if(length > 0 && path[length - 1] != '/')
+        {
+            path[length++] = '/';
+        }
+        if(length + node->length >= PATH_MAX)
+        {
+            return 0;
+        }
+        memcpy(path + length, node->name, node->length);
+        length += node->length;
+    }
+    path[length] = '\0';
+    return length;
+}
+
+/*
+ * Adding directory to the queue of this thread. Only its name is copied, the parent is shared.
+ * Sleeping threads are woken only when there is one, so a busy search never takes park_lock.
+ */
+int AddNewDirToQueue(DirectoryNode *parent, const char *name, size_t length)
+{
+    DirectoryNode *node = AllocateNode(length);
+    if(node == NULL) {
+        fprintf(stderr, "Error in allocating memory for Node.");
+        return False;
+    }
+
+    node->parent = parent;
+    node->refs = 1;
+    node->length = length;
+    memcpy(node->name, name, length);
+    node->name[length] = '\0';
+    if(parent != NULL)
+    {
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED); //The parent is being scanned, so it lives.
+    }
+    //Counted before anyone can take it, and the parent is still counted, so Outstanding can't reach 0 early.
+    __atomic_add_fetch(&Outstanding, 1, __ATOMIC_RELAXED);
+    PushDirectory(&Deques[ThreadIndex], node);
+
+    //Either a thread going to sleep sees this directory, or we see it sleeping.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&SleepThreads, __ATOMIC_RELAXED) > 0)
+    {
+        pthread_mutex_lock(&park_lock);
+        Wakeup();
+        pthread_mutex_unlock(&park_lock);
+    }
+    return True;
+}
+
+/*
+ * Writing all of a buffer to a file. Returns False on an error, with errno set.
+ */
+int WriteAllTo(int file_desc, const char *buffer, size_t length)
+{
+    while(length > 0)
+    {
+        ssize_t written = write(file_desc, buffer, length);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written < 0)
+            return False;
+        buffer += written;
+        length -= written;
+    }
+    return True;
+}
+
+/*
+ * Writing all of a buffer to stdout.
+ */
+void WriteAll(const char *buffer, size_t length)
+{
+    if(!WriteAllTo(STDOUT_FILENO, buffer, length))
+    {
+        perror("Error in writing matches");
+    }
+}
+
+/*
+ * Writing the buffered matches of this thread. Sorted output is kept for the end.
+ * Writes bigger than PIPE_BUF may interleave, so the lock keeps lines whole. It is taken once per buffer.
+ */
+void FlushOutput()
+{
+    OutputBuffer *output = &Deques[ThreadIndex].output;
+    if(!Sorted && output->length > 0)
+    {
+        pthread_mutex_lock(&output_lock);
+        WriteAll(output->buffer, output->length);
+        pthread_mutex_unlock(&output_lock);
+        output->length = 0;
+    }
+}
+
+/*
+ * Ending the search, all threads are woken to exit. Called with park_lock held.
+ */
+void EndSearch()
+{
+    SearchDone = True;
+    pthread_cond_broadcast(&work_available);
+}
+
+/*
+ * Finishing a directory taken from a queue. The thread that finishes the last one ends the search.
+ */
+void FinishDirectory()
+{
+    if(__atomic_sub_fetch(&Outstanding, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        pthread_mutex_lock(&park_lock);
+        EndSearch();
+        pthread_mutex_unlock(&park_lock);
+    }
+}
+
+/*
+ * Making thread to sleep until a directory is queued. Returns False when the search is over.
+ * The thread is counted as sleeping before the last look at the queues, which pairs with AddNewDirToQueue.
+ */
+int WaitForData()
+{
+    int done;
+
+    FlushOutput(); //Matches are out before the thread sleeps.
+    pthread_mutex_lock(&park_lock);
+    __atomic_store_n(&SleepThreads, SleepThreads + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(SearchDone || !IsEmpty())
+    {
+        __atomic_store_n(&SleepThreads, SleepThreads - 1, __ATOMIC_RELAXED);
+        done = SearchDone;
+        pthread_mutex_unlock(&park_lock);
+        return !done;
+    }
+
+    while(WakeupsPending == 0 && !SearchDone)
+    {
+        pthread_cond_wait(&work_available, &park_lock);
+    }
+    if(WakeupsPending > 0)
+    {
+        WakeupsPending--;
+    }
+    done = SearchDone;
+    pthread_mutex_unlock(&park_lock);
+    return !done;
+}
+
+/*
+ * Taking the next directory: own queue first, then from random threads.
+ */
+DirectoryNode* RemoveDirFromQueue()
+{
+    Deque *self = &Deques[ThreadIndex];
+    DirectoryNode *node = PopDirectory(self);
+
+    for(int round = 0; node == NULL && round < STEAL_ROUNDS * NumberOfThreads; round++)
+    {
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 7;
+        self->seed ^= self->seed << 17;
+        long victim = self->seed % NumberOfThreads;
+        if(victim != ThreadIndex)
+        {
+            node = StealDirectory(&Deques[victim]);
+        }
+    }
+    return node;
+}
+
+/*
+ * Appending to a growing buffer.
+ */
+void IndexAppend(IndexBuffer *buffer, const void *data, size_t length)
+{
+    if(length == 0)
+        return;
+    if(buffer->length + length > buffer->size)
+    {
+        size_t size = buffer->size * 2 + length + INDEX_BUFFER_BYTES;
+        char *grown = realloc(buffer->buffer, size);
+        if(grown == NULL)
+        {
+            fprintf(stderr, "Error in allocating index.\n");
+            exit(1);
+        }
+        buffer->buffer = grown;
+        buffer->size = size;
+    }
+    memcpy(buffer->buffer + buffer->length, data, length);
+    buffer->length += length;
+}
+
+/*
+ * If pattern was found we buffer its path and increase the counter of this thread.
+ */
+void IncreaseCounter(const char *path, size_t length)
+{
+    OutputBuffer *output = &Deques[ThreadIndex].output;
+
+    if(WatchFd >= 0)
+    {
+        //--watch keeps every match, to tell when it is removed. Matches of later scans are announced by WatchLoop.
+        IndexAppend(&Deques[ThreadIndex].found, path, length);
+        IndexAppend(&Deques[ThreadIndex].found, "", 1);
+        if(Rescanning)
+            return;
+    }
+
+    if(output->length + length + 1 > output->size)
+    {
+        FlushOutput();
+        if(output->length + length + 1 > output->size)
+        {
+            size_t size = output->size;
+            while(output->length + length + 1 > size)
+                size *= 2;
+            char *buffer = realloc(output->buffer, size);
+            if(buffer == NULL)
+            {
+                fprintf(stderr, "Error in allocating output.");
+                return;
+            }
+            output->buffer = buffer;
+            output->size = size;
+        }
+    }
+
+    memcpy(output->buffer + output->length, path, length);
+    output->buffer[output->length + length] = '\n';
+    output->length += length + 1;
+    output->matches++;
+}
+
+static int ComparePaths(const void *first, const void *second)
+{
+    return strcmp(*(char * const *)first, *(char * const *)second);
+}
+
+/*
+ * Writing the matches of all threads in path order, after the search.
+ */
+void WriteSortedOutput()
+{
+    size_t count = 0, done = 0;
+    char **paths;
+
+    for(int i=0; i<NumberOfThreads; i++)
+    {
+        count += Deques[i].output.matches;
+    }
+    paths = malloc((count + 1) * sizeof(char *));
+    if(paths == NULL)
+    {
+        fprintf(stderr, "Error in allocating output.");
+        return;
+    }
+
+    //Every line ends with a newline, which becomes the end of its string.
+    for(int i=0; i<NumberOfThreads; i++)
+    {
+        OutputBuffer *output = &Deques[i].output;
+        for(size_t start = 0; start < output->length; )
+        {
+            char *end = memchr(output->buffer + start, '\n', output->length - start);
+            *end = '\0';
+            paths[done++] = output->buffer + start;
+            start = end - output->buffer + 1;
+        }
+    }
+    qsort(paths, count, sizeof(char *), ComparePaths);
+
+    OutputBuffer merged = {malloc(OUTPUT_BUFFER_BYTES), 0, OUTPUT_BUFFER_BYTES, 0};
+    if(merged.buffer == NULL)
+    {
+        fprintf(stderr, "Error in allocating output.");
+        free(paths);
+        return;
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t length = strlen(paths[i]);
+        if(merged.length + length + 1 > merged.size)
+        {
+            WriteAll(merged.buffer, merged.length);
+            merged.length = 0;
+        }
+        if(length + 1 > merged.size)
+        {
+            paths[i][length] = '\n';
+            WriteAll(paths[i], length + 1);
+            continue;
+        }
+        memcpy(merged.buffer + merged.length, paths[i], length);
+        merged.buffer[merged.length + length] = '\n';
+        merged.length += length + 1;
+    }
+    WriteAll(merged.buffer, merged.length);
+    free(merged.buffer);
+    free(paths);
+}
+
+/*
+ * -----Patterns-------
+ */
+/*
+ * Scalar search of the only literal, for names too short for a vector and for other CPUs.
+ */
+int FindLiteralScalar(const char *name, size_t length)
+{
+    return memmem(name, length, Literals[0], LiteralLength) != NULL;
+}
+
+int FindLiteralByte(const char *name, size_t length)
+{
+    return memchr(name, Literals[0][0], length) != NULL;
+}
+
+#if defined(__x86_64__)
+/*
+ * Vector search of the only literal. Every start position whose first and last bytes both match the
+ * literal's is checked with memcmp, 16 positions at a time. The last block is moved back to end exactly
+ * at the last start position, so no load passes the end of the name.
+ */
+int FindLiteralSse2(const char *name, size_t length)
+{
+    const __m128i first = _mm_set1_epi8(Literals[0][0]);
+    const __m128i last = _mm_set1_epi8(Literals[0][LiteralLength - 1]);
+    size_t starts = length - LiteralLength + 1;
+
+    if(length < LiteralLength + 15)
+        return FindLiteralScalar(name, length);
+
+    for(size_t i = 0; ; i += 16)
+    {
+        if(i + 16 > starts)
+            i = starts - 16;
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(name + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(name + i + LiteralLength - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                        _mm_cmpeq_epi8(last, block_last)));
+        while(mask != 0)
+        {
+            if(memcmp(name + i + __builtin_ctz(mask) + 1, Literals[0] + 1, LiteralLength - 2) == 0)
+                return True;
+            mask &= mask - 1;
+        }
+        if(i + 16 >= starts)
+            return False;
+    }
+}
+
+/*
+ * Same as FindLiteralSse2, 32 positions at a time. Only used when the CPU has AVX2.
+ */
+__attribute__((target("avx2")))
+int FindLiteralAvx2(const char *name, size_t length)
+{
+    const __m256i first = _mm256_set1_epi8(Literals[0][0]);
+    const __m256i last = _mm256_set1_epi8(Literals[0][LiteralLength - 1]);
+    size_t starts = length - LiteralLength + 1;
+
+    if(length < LiteralLength + 31)
+        return FindLiteralSse2(name, length);
+
+    for(size_t i = 0; ; i += 32)
+    {
+        if(i + 32 > starts)
+            i = starts - 32;
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(name + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(name + i + LiteralLength - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                                              _mm256_cmpeq_epi8(last, block_last)));
+        while(mask != 0)
+        {
+            if(memcmp(name + i + __builtin_ctz(mask) + 1, Literals[0] + 1, LiteralLength - 2) == 0)
+                return True;
+            mask &= mask - 1;
+        }
+        if(i + 32 >= starts)
+            return False;
+    }
+}
+#endif
+
+/*
+ * Building the automaton of all literals. The trie is built first, then its states are visited breadth
+ * first, so the failure state of every state is complete before the state itself is.
+ */
+void BuildAutomaton()
+{
+    size_t total = 1;
+    int *failure, *queue;
+    int head = 0, tail = 0;
+
+    for(int i = 0; i < LiteralCount; i++)
+        total += strlen(Literals[i]);
+    Automaton.states = 1;
+    Automaton.next = malloc(total * 256 * sizeof(int));
+    Automaton.accept = calloc(total, sizeof(char));
+    failure = malloc(total * sizeof(int));
+    queue = malloc(total * sizeof(int));
+    if(Automaton.next == NULL || Automaton.accept == NULL || failure == NULL || queue == NULL)
+    {
+        fprintf(stderr, "Error in pattern allocation.\n");
+        exit(1);
+    }
+    memset(Automaton.next, -1, total * 256 * sizeof(int));
+
+    for(int i = 0; i < LiteralCount; i++)
+    {
+        int state = AC_ROOT;
+        for(const unsigned char *c = (const unsigned char *)Literals[i]; *c != '\0'; c++)
+        {
+            if(Automaton.next[state * 256 + *c] < 0)
+                Automaton.next[state * 256 + *c] = Automaton.states++;
+            state = Automaton.next[state * 256 + *c];
+        }
+        Automaton.accept[state] = True;
+    }
+
+    failure[AC_ROOT] = AC_ROOT;
+    queue[tail++] = AC_ROOT;
+    while(head < tail)
+    {
+        int state = queue[head++];
+        for(int c = 0; c < 256; c++)
+        {
+            int *child = &Automaton.next[state * 256 + c];
+            int fallback = state == AC_ROOT ? AC_ROOT : Automaton.next[failure[state] * 256 + c];
+            if(*child < 0)
+            {
+                *child = fallback;
+                continue;
+            }
+            failure[*child] = fallback;
+            Automaton.accept[*child] |= Automaton.accept[fallback];
+            queue[tail++] = *child;
+        }
+    }
+    free(failure);
+    free(queue);
+}
+
+int AutomatonMatch(const char *name)
+{
+    int state = AC_ROOT;
+    for(const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++)
+    {
+        state = Automaton.next[state * 256 + *c];
+        if(Automaton.accept[state])
+            return True;
+    }
+    return False;
+}
+
+/*
+ * Translating a glob to an extended regex matching whole names. * and ? match any characters,
+ * [...] and [!...] are brackets, and a backslash quotes the next character.
+ */
+char *GlobToRegex(const char *glob)
+{
+    char *regex = malloc(strlen(glob) * 2 + 3);
+    char *out = regex;
+
+    if(regex == NULL)
+    {
+        fprintf(stderr, "Error in pattern allocation.\n");
+        exit(1);
+    }
+    *out++ = '^';
+    for(const char *c = glob; *c != '\0'; c++)
+    {
+        const char *close = NULL;
+        if(*c == '[')
+        {
+            //The first character after [ or [! is part of the bracket, even when it is ].
+            close = c + 1 + (c[1] == '!' || c[1] == '^');
+            close = *close == '\0' ? NULL : strchr(close + 1, ']');
+        }
+        if(close != NULL)
+        {
+            *out++ = '[';
+            c++;
+            if(*c == '!')
+            {
+                *out++ = '^';
+                c++;
+            }
+            while(c < close)
+                *out++ = *c++;
+            *out++ = ']';
+        }
+        else if(*c == '*')
+        {
+            *out++ = '.';
+            *out++ = '*';
+        }
+        else if(*c == '?')
+        {
+            *out++ = '.';
+        }
+        else
+        {
+            if(*c == '\\' && c[1] != '\0')
+                c++;
+            if(strchr(".^$+*?()[]{}|\\", *c) != NULL)
+                *out++ = '\\';
+            *out++ = *c;
+        }
+    }
+    *out++ = '$';
+    *out = '\0';
+    return regex;
+}
+
+/*
+ * Compiling all patterns once, before the search. glibc serializes regexec calls on one regex_t,
+ * so every thread gets its own copies.
+ */
+void CompilePatterns()
+{
+    char error[256];
+
+    MatchAll = False;
+    for(int i = 0; i < LiteralCount; i++)
+        MatchAll |= Literals[i][0] == '\0';
+
+    if(LiteralCount == 1)
+    {
+        LiteralLength = strlen(Literals[0]);
+        FindLiteral = LiteralLength == 1 ? FindLiteralByte : FindLiteralScalar;
+#if defined(__x86_64__)
+        if(LiteralLength > 1)
+            FindLiteral = __builtin_cpu_supports("avx2") ? FindLiteralAvx2 : FindLiteralSse2;
+#endif
+    }
+    else if(LiteralCount > 1)
+    {
+        BuildAutomaton();
+    }
+
+    Regexes = malloc((RegexCount * NumberOfThreads + 1) * sizeof(regex_t));
+    if(Regexes == NULL)
+    {
+        fprintf(stderr, "Error in pattern allocation.\n");
+        exit(1);
+    }
+    for(int i = 0; i < RegexCount * NumberOfThreads; i++)
+    {
+        int ret = regcomp(&Regexes[i], RegexSources[i % RegexCount], REG_EXTENDED | REG_NOSUB);
+        if(ret != 0)
+        {
+            regerror(ret, &Regexes[i], error, sizeof(error));
+            fprintf(stderr, "Error in pattern %s: %s\n", RegexSources[i % RegexCount], error);
+            exit(1);
+        }
+    }
+}
+
+void FreePatterns()
+{
+    for(int i = 0; i < RegexCount * NumberOfThreads; i++)
+        regfree(&Regexes[i]);
+    for(int i = 0; i < RegexCount; i++)
+        free(RegexSources[i]);
+    free(Regexes);
+    free(RegexSources);
+    free(Literals);
+    free(Automaton.next);
+    free(Automaton.accept);
+}
+
+/*
+ * Check if the name matches any of the patterns. Literals are cheapest, so they go first.
+ */
+int EqualToPattern(const char *name)
+{
+    if(MatchAll)
+        return True;
+    if(LiteralCount == 1 && FindLiteral(name, strlen(name)))
+        return True;
+    if(LiteralCount > 1 && AutomatonMatch(name))
+        return True;
+
+    regex_t *regexes = &Regexes[ThreadIndex * RegexCount];
+    for(int i = 0; i < RegexCount; i++)
+    {
+        if(regexec(&regexes[i], name, 0, NULL, 0) == 0)
+            return True;
+    }
+    return False;
+}
+
+/*
+ * -----Index-------
+ */
+/*
+ * The index is one file, mapped when it is used:
+ *  - IndexHeader, with the root the index was built from.
+ *  - Blocks of up to INDEX_BLOCK_DIRECTORIES directories, sorted by path. A directory is its path,
+ *    front coded against the previous directory of its block, its mtime, and its entries,
+ *    sorted and front coded against each other. The entries are preceded by their count and their bytes,
+ *    so a lookup skips them without decoding.
+ *  - The offsets of the blocks. Blocks are decoded on their own, so queries split them between threads.
+ * Numbers are LEB128 varints, except the mtime, which is 8 bytes.
+ */
+void IndexAppendNumber(IndexBuffer *buffer, unsigned long long value)
+{
+    unsigned char bytes[10];
+    int length = 0;
+
+    do
+    {
+        bytes[length++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+        value >>= 7;
+    }while(value != 0);
+    IndexAppend(buffer, bytes, length);
+}
+
+/*
+ * Starting the record of a scanned directory in the buffer of this thread. Its entries follow.
+ */
+void IndexBeginDirectory(const char *path, size_t length, long long mtime)
+{
+    IndexBuffer *records = &Deques[ThreadIndex].records;
+    IndexRecord record = {.mtime = mtime, .path_length = length, .count = 0, .bytes = 0};
+    static const char padding[8];
+
+    IndexAppend(records, padding, -records->length & 7);
+    records->open = records->length;
+    IndexAppend(records, &record, offsetof(IndexRecord, path));
+    IndexAppend(records, path, length);
+    IndexAppend(records, "", 1);
+    records->directories++;
+}
+
+void IndexAddEntry(const char *name, int is_directory)
+{
+    IndexBuffer *records = &Deques[ThreadIndex].records;
+    char flag = is_directory;
+    size_t length = strlen(name) + 1;
+
+    IndexAppend(records, &flag, 1);
+    IndexAppend(records, name, length);
+    IndexRecord *record = (IndexRecord *)(records->buffer + records->open);
+    record->count++;
+    record->bytes += length + 1;
+    records->entries++;
+}
+
+static int CompareRecords(const void *first, const void *second)
+{
+    return strcmp((*(IndexRecord **)first)->path, (*(IndexRecord **)second)->path);
+}
+
+static int CompareEntries(const void *first, const void *second)
+{
+    return strcmp(*(char **)first + 1, *(char **)second + 1);
+}
+
+/*
+ * Length of the common start of two strings.
+ */
+static size_t SharedLength(const char *first, const char *second)
+{
+    size_t length = 0;
+    while(first[length] != '\0' && first[length] == second[length])
+        length++;
+    return length;
+}
+
+/*
+ * Writing the records of all threads as an index. It is written next to the old one and renamed over it,
+ * so a search that still maps the old index is not disturbed.
+ */
+void WriteIndex(const char *file, const char *root)
+{
+    IndexBuffer output = {0}, coded = {0};
+    IndexHeader header = {.magic = INDEX_MAGIC};
+    IndexRecord **records;
+    char **entries = NULL;
+    unsigned long long *blocks;
+    char temporary[PATH_MAX];
+    long count = 0, max_entries = 0;
+    static const char padding[8];
+
+    for(int i = 0; i < NumberOfThreads; i++)
+        count += Deques[i].records.directories;
+    records = malloc((count + 1) * sizeof(IndexRecord *));
+    blocks = malloc((count / INDEX_BLOCK_DIRECTORIES + 1) * sizeof(unsigned long long));
+    if(records == NULL || blocks == NULL)
+    {
+        fprintf(stderr, "Error in allocating index.\n");
+        exit(1);
+    }
+    count = 0;
+    for(int i = 0; i < NumberOfThreads; i++)
+    {
+        IndexBuffer *buffer = &Deques[i].records;
+        for(size_t offset = 0; offset < buffer->length; )
+        {
+            IndexRecord *record = (IndexRecord *)(buffer->buffer + offset);
+            records[count++] = record;
+            max_entries = record->count > max_entries ? record->count : max_entries;
+            offset += (offsetof(IndexRecord, path) + record->path_length + 1 + record->bytes + 7) & ~(size_t)7;
+        }
+        header.entries += buffer->entries;
+    }
+    qsort(records, count, sizeof(IndexRecord *), CompareRecords);
+    entries = malloc((max_entries + 1) * sizeof(char *));
+    if(entries == NULL)
+    {
+        fprintf(stderr, "Error in allocating index.\n");
+        exit(1);
+    }
+
+    header.directories = count;
+    header.root_length = strlen(root);
+    IndexAppend(&output, &header, sizeof(header));
+    IndexAppend(&output, root, header.root_length + 1);
+    for(long i = 0; i < count; i++)
+    {
+        IndexRecord *record = records[i];
+        size_t shared = 0;
+        if(i % INDEX_BLOCK_DIRECTORIES == 0)
+            blocks[header.blocks++] = output.length;
+        else
+            shared = SharedLength(records[i - 1]->path, record->path);
+        IndexAppendNumber(&output, shared);
+        IndexAppendNumber(&output, record->path_length - shared);
+        IndexAppend(&output, record->path + shared, record->path_length - shared);
+        IndexAppend(&output, &record->mtime, sizeof(record->mtime));
+
+        //Entries are a flag byte, then the name.
+        char *entry = record->path + record->path_length + 1;
+        for(unsigned j = 0; j < record->count; j++)
+        {
+            entries[j] = entry;
+            entry += strlen(entry + 1) + 2;
+        }
+        qsort(entries, record->count, sizeof(char *), CompareEntries);
+        coded.length = 0;
+        for(unsigned j = 0; j < record->count; j++)
+        {
+            size_t length = strlen(entries[j] + 1);
+            shared = j == 0 ? 0 : SharedLength(entries[j - 1] + 1, entries[j] + 1);
+            IndexAppendNumber(&coded, shared << 1 | entries[j][0]);
+            IndexAppendNumber(&coded, length - shared);
+            IndexAppend(&coded, entries[j] + 1 + shared, length - shared);
+        }
+        IndexAppendNumber(&output, record->count);
+        IndexAppendNumber(&output, coded.length);
+        IndexAppend(&output, coded.buffer, coded.length);
+    }
+    IndexAppend(&output, padding, -output.length & 7);
+    header.blocks_offset = output.length;
+    IndexAppend(&output, blocks, header.blocks * sizeof(unsigned long long));
+    header.bytes = output.length;
+    memcpy(output.buffer, &header, sizeof(header));
+
+    snprintf(temporary, sizeof(temporary), "%s.%d", file, (int)getpid());
+    int file_desc = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(file_desc < 0)
+    {
+        perror("Error in writing index");
+        exit(1);
+    }
+    int written = WriteAllTo(file_desc, output.buffer, output.length);
+    if(close(file_desc) < 0 || !written || rename(temporary, file) < 0)
+    {
+        perror("Error in writing index");
+        unlink(temporary);
+        exit(1);
+    }
+    free(output.buffer);
+    free(coded.buffer);
+    free(entries);
+    free(blocks);
+    free(records);
+}
+
+/*
+ * Mapping an index, and checking that its blocks are inside it.
+ */
+void OpenIndex(const char *file)
+{
+    struct stat info;
+    int file_desc = open(file, O_RDONLY | O_CLOEXEC);
+
+    if(file_desc < 0 || fstat(file_desc, &info) < 0)
+    {
+        perror("Error in opening index");
+        exit(1);
+    }
+    IndexBytes = info.st_size;
+    Index = IndexBytes >= sizeof(IndexHeader) ? mmap(NULL, IndexBytes, PROT_READ, MAP_PRIVATE, file_desc, 0) : MAP_FAILED;
+    close(file_desc);
+    if(Index == MAP_FAILED)
+    {
+        fprintf(stderr, "Error in mapping index %s.\n", file);
+        exit(1);
+    }
+
+    const unsigned long long *blocks = (const unsigned long long *)((char *)Index + Index->blocks_offset);
+    size_t data = sizeof(IndexHeader) + Index->root_length + 1;
+    int valid = memcmp(Index->magic, INDEX_MAGIC, sizeof(Index->magic)) == 0 && Index->bytes == IndexBytes &&
+                Index->root_length < PATH_MAX && data <= Index->blocks_offset && Index->blocks_offset <= IndexBytes &&
+                Index->blocks <= (IndexBytes - Index->blocks_offset) / sizeof(unsigned long long) &&
+                Index->root[Index->root_length] == '\0';
+    for(unsigned long long i = 0; valid && i < Index->blocks; i++)
+    {
+        valid = blocks[i] >= data && blocks[i] <= Index->blocks_offset;
+        data = blocks[i];
+    }
+    if(!valid)
+    {
+        fprintf(stderr, "Index %s is damaged, build it again.\n", file);
+        exit(1);
+    }
+}
+
+static int IndexNumber(IndexCursor *cursor, unsigned long long *value)
+{
+    *value = 0;
+    for(int shift = 0; cursor->at < cursor->end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *cursor->at++;
+        *value |= (unsigned long long)(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+            return True;
+    }
+    return False;
+}
+
+/*
+ * Reading front coded text into a buffer that holds the previous one.
+ */
+static int IndexText(IndexCursor *cursor, char *text, size_t *length, size_t shared, size_t limit)
+{
+    unsigned long long suffix;
+
+    if(!IndexNumber(cursor, &suffix) || shared > *length || suffix >= limit - shared ||
+       suffix > (size_t)(cursor->end - cursor->at))
+        return False;
+    memcpy(text + shared, cursor->at, suffix);
+    cursor->at += suffix;
+    *length = shared + suffix;
+    text[*length] = '\0';
+    return True;
+}
+
+void IndexOpenBlock(IndexCursor *cursor, unsigned long long block)
+{
+    const unsigned long long *blocks = (const unsigned long long *)((char *)Index + Index->blocks_offset);
+
+    cursor->at = (const unsigned char *)Index + blocks[block];
+    cursor->end = (const unsigned char *)Index + (block + 1 < Index->blocks ? blocks[block + 1] : Index->blocks_offset);
+    cursor->entries_end = cursor->at;
+    cursor->path_length = 0;
+    cursor->left = 0;
+    cursor->first = True;
+}
+
+/*
+ * Moving to the next entry of the current directory. Returns False after its last one.
+ */
+int IndexNextEntry(IndexCursor *cursor)
+{
+    unsigned long long shared;
+
+    if(cursor->left == 0 || cursor->at >= cursor->entries_end)
+        return False;
+    cursor->left--;
+    if(!IndexNumber(cursor, &shared) ||
+       !IndexText(cursor, cursor->name, &cursor->name_length, cursor->first_entry ? 0 : shared >> 1, sizeof(cursor->name)))
+    {
+        cursor->at = cursor->end; //Damaged, the rest of the block is skipped.
+        cursor->entries_end = cursor->end;
+        cursor->left = 0;
+        return False;
+    }
+    cursor->is_directory = shared & 1;
+    cursor->first_entry = False;
+    return True;
+}
+
+/*
+ * Moving to the next directory of the block, skipping what is left of the current one.
+ * Returns False at the end of the block.
+ */
+int IndexNextDirectory(IndexCursor *cursor)
+{
+    unsigned long long shared, count, bytes;
+
+    cursor->at = cursor->entries_end;
+    if(cursor->at >= cursor->end)
+        return False;
+    if(!IndexNumber(cursor, &shared) ||
+       !IndexText(cursor, cursor->path, &cursor->path_length, cursor->first ? 0 : shared, sizeof(cursor->path)) ||
+       cursor->end - cursor->at < (long)sizeof(cursor->mtime))
+    {
+        cursor->at = cursor->entries_end = cursor->end;
+        return False;
+    }
+    memcpy(&cursor->mtime, cursor->at, sizeof(cursor->mtime));
+    cursor->at += sizeof(cursor->mtime);
+    if(!IndexNumber(cursor, &count) || !IndexNumber(cursor, &bytes) || bytes > (size_t)(cursor->end - cursor->at))
+    {
+        cursor->at = cursor->entries_end = cursor->end;
+        return False;
+    }
+    cursor->entries_end = cursor->at + bytes;
+    cursor->left = count;
+    cursor->first = False;
+    cursor->first_entry = True;
+    cursor->name_length = 0;
+    return True;
+}
+
+/*
+ * Finding a directory in the index: the last block starting at or before its path, then a walk of the block.
+ */
+int IndexFind(IndexCursor *cursor, const char *path)
+{
+    long low = 0, high = (long)Index->blocks - 1, found = -1;
+
+    while(low <= high)
+    {
+        long middle = (low + high) / 2;
+        IndexOpenBlock(cursor, middle);
+        if(IndexNextDirectory(cursor) && strcmp(cursor->path, path) <= 0)
+        {
+            found = middle;
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    if(found < 0)
+        return False;
+
+    IndexOpenBlock(cursor, found);
+    while(IndexNextDirectory(cursor))
+    {
+        int order = strcmp(cursor->path, path);
+        if(order >= 0)
+            return order == 0;
+    }
+    return False;
+}
+
+/*
+ * Options come before or between the arguments. Returns the index of the first argument.
+ * -e, -g and -r may repeat, a name matching any of the patterns is printed once.
+ */
+int ParseOptions(int argc, char *argv[])
+{
+    static struct option options[] = {
+        {"sorted", no_argument, NULL, 's'},
+        {"pattern", required_argument, NULL, 'e'},
+        {"glob", required_argument, NULL, 'g'},
+        {"regex", required_argument, NULL, 'r'},
+        {"uring", optional_argument, NULL, 'u'},
+        {"build-index", required_argument, NULL, 'B'},
+        {"refresh", required_argument, NULL, 'R'},
+        {"index", required_argument, NULL, 'I'},
+        {"watch", no_argument, NULL, 'w'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+
+    Sorted = False;
+    UringDepth = 0;
+    IndexMode = NO_INDEX;
+    Watching = False;
+    LiteralCount = RegexCount = 0;
+    Literals = malloc((argc + 1) * sizeof(char *));
+    RegexSources = malloc((argc + 1) * sizeof(char *));
+    if(Literals == NULL || RegexSources == NULL)
+    {
+        fprintf(stderr, "Error in pattern allocation.\n");
+        exit(1);
+    }
+    while((opt = getopt_long(argc, argv, "se:g:r:u::", options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                Sorted = True;
+                break;
+            case 'e':
+                Literals[LiteralCount++] = optarg;
+                break;
+            case 'g':
+                RegexSources[RegexCount++] = GlobToRegex(optarg);
+                break;
+            case 'r':
+                RegexSources[RegexCount++] = strdup(optarg);
+                break;
+            case 'u':
+                UringDepth = optarg != NULL ? atoi(optarg) : DEFAULT_URING_DEPTH;
+                if(UringDepth <= 0 || UringDepth > MAX_URING_DEPTH)
+                {
+                    fprintf(stderr, "Error in the io_uring depth.\n");
+                    exit(1);
+                }
+                break;
+            case 'w':
+                Watching = True;
+                break;
+            case 'B':
+            case 'R':
+            case 'I':
+                if(IndexMode != NO_INDEX)
+                {
+                    fprintf(stderr, "Only one of --build-index, --refresh and --index may be given.\n");
+                    exit(1);
+                }
+                IndexMode = opt == 'B' ? INDEX_BUILD : opt == 'R' ? INDEX_REFRESH : INDEX_QUERY;
+                IndexFile = optarg;
+                break;
+            default:
+                fprintf(stderr, USAGE_MSG);
+                exit(1);
+        }
+    }
+    if(Watching && IndexMode != NO_INDEX)
+    {
+        fprintf(stderr, "--watch watches the file system, not an index.\n");
+        exit(1);
+    }
+    return optind;
+}
+
+/*
+ * Initiating all relevant data structures for start working.
+ */
+void Init(int argc, char *argv[])
+{
+    //Check args. They are the root, the pattern and the number of threads. Indexes are built without
+    //a pattern, and searched or refreshed without a root. The pattern may be left out when options gave others.
+    int first = ParseOptions(argc, argv);
+    int args = argc - first;
+    int takes_root = IndexMode == NO_INDEX || IndexMode == INDEX_BUILD;
+    int takes_pattern = IndexMode == NO_INDEX || IndexMode == INDEX_QUERY;
+    int given_pattern = takes_pattern && args == takes_root + 2;
+    if(args != takes_root + given_pattern + 1 || (takes_pattern && !given_pattern && LiteralCount + RegexCount == 0))
+    {
+        fprintf(stderr,"Error in the number of arguments.\n");
+        fprintf(stderr, USAGE_MSG);
+        exit(1);
+    }
+    argv += first;
+    if(given_pattern)
+    {
+        Literals[LiteralCount++] = argv[takes_root];
+    }
+
+    //Init counter.
+    PatternCounter = 0;
+    SleepThreads = 0;
+    WakeupsPending = 0;
+    Outstanding = 0;
+    SearchDone = False;
+    ThreadErrorsCounter = 0;
+
+    //Init fields.
+    NumberOfThreads = atoi(argv[args - 1]);
+    if(NumberOfThreads <= 0)
+    {
+        fprintf(stderr, "Error in the number of threads");
+        exit(1);
+    }
+    CompilePatterns();
+    WatchFd = Watching ? inotify_init1(IN_CLOEXEC) : -1;
+    if(Watching && WatchFd < 0)
+    {
+        perror("Error in inotify_init1");
+        exit(1);
+    }
+    ThreadList = malloc(NumberOfThreads * sizeof(pthread_t));
+    ThreadStarted = calloc(NumberOfThreads, sizeof(char));
+    Deques = aligned_alloc(64, NumberOfThreads * sizeof(Deque));
+    if(ThreadList == NULL || ThreadStarted == NULL || Deques == NULL)
+    {
+        fprintf(stderr, "Error in list allocation.");
+        exit(1);
+    }
+    for(int i=0; i<NumberOfThreads; i++)
+    {
+        Deques[i].top = Deques[i].bottom = 0;
+        Deques[i].array = NewDequeArray(INITIAL_DEQUE_SIZE);
+        Deques[i].seed = 0x9e3779b97f4a7c15UL * (i + 1);
+        Deques[i].chunk = NULL;
+        Deques[i].chunk_used = 0;
+        Deques[i].output.buffer = malloc(OUTPUT_BUFFER_BYTES);
+        Deques[i].output.length = 0;
+        Deques[i].output.size = OUTPUT_BUFFER_BYTES;
+        Deques[i].output.matches = 0;
+        memset(&Deques[i].records, 0, sizeof(IndexBuffer));
+        memset(&Deques[i].watches, 0, sizeof(IndexBuffer));
+        memset(&Deques[i].found, 0, sizeof(IndexBuffer));
+        if(Deques[i].output.buffer == NULL)
+        {
+            fprintf(stderr, "Error in list allocation.");
+            exit(1);
+        }
+    }
+
+    //An index is searched without a scan. It is refreshed by scanning its root again.
+    char *root = argv[0];
+    if(IndexMode == INDEX_QUERY || IndexMode == INDEX_REFRESH)
+    {
+        OpenIndex(IndexFile);
+        if(IndexMode == INDEX_QUERY)
+            return;
+        root = Index->root;
+    }
+    else if(IndexMode == INDEX_BUILD)
+    {
+        //Indexes keep absolute paths, so they can be searched from anywhere.
+        root = realpath(argv[0], NULL);
+        if(root == NULL)
+        {
+            fprintf(stderr, "Root is not searchable.\n");
+            exit(1);
+        }
+    }
+
+    //Adding root to the queue of the first thread, the others steal from it.
+    if (DirectorySearchable(root) && strlen(root) < PATH_MAX) {
+        ThreadIndex = 0;
+        AddNewDirToQueue(NULL, root, strlen(root));
+        IndexRoot = root;
+    }
+    else
+    {
+        fprintf(stderr, "Root is not searchable.\n");
+        exit(1);
+    }
+}
+
+/*
+ * Check if we need to ignore file.
+ */
+int IgnoreFile(const char *file)
+{
+    return (strcmp(file, ".") == 0) || (strcmp(file, "..") == 0);
+}
+
+/*
+ * Type of a directory entry, from d_type when the file system fills it.
+ * Only DT_UNKNOWN costs an fstatat, relative to the open directory, so there is no path walk.
+ * Symbolic links are not followed, like lstat.
+ */
+int EntryIsDirectory(int dir_fd, const char *name, unsigned char type)
+{
+    struct stat f_info;
+
+    if(type != DT_UNKNOWN)
+    {
+        return type == DT_DIR;
+    }
+    if(fstatat(dir_fd, name, &f_info, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+        fprintf(stderr, "Unable get %s status.\n", name);
+        return False;
+    }
+    return S_ISDIR(f_info.st_mode);
+}
+
+/*
+ * Writing directory/name into path. prefix is the length of directory with its separator.
+ * Returns False when the path doesn't fit.
+ */
+int JoinPath(char *path, size_t prefix, const char *name)
+{
+    size_t name_length = strlen(name);
+    if(prefix + name_length >= PATH_MAX)
+    {
+        fprintf(stderr, "Path too long: %.*s%s\n", (int)prefix, path, name);
+        return False;
+    }
+    memcpy(path + prefix, name, name_length + 1);
+    return True;
+}
+
+/*
+ * Queueing a directory entry or matching it. Full paths are built only for matches.
+ */
+void ScanEntry(int dir_fd, DirectoryNode *node, char *path, size_t prefix, const char *name, unsigned char type)
+{
+    if(IgnoreFile(name))
+        return;
+
+    if(EntryIsDirectory(dir_fd, name, type))
+    {
+        size_t length = strlen(name);
+        if(prefix + length >= PATH_MAX)
+            fprintf(stderr, "Path too long: %.*s%s\n", (int)prefix, path, name);
+        else
+            AddNewDirToQueue(node, name, length);
+        if(IndexMode == INDEX_BUILD || IndexMode == INDEX_REFRESH)
+            IndexAddEntry(name, True);
+    }
+    else if(IndexMode == INDEX_BUILD || IndexMode == INDEX_REFRESH)
+    {
+        IndexAddEntry(name, False);
+    }
+    else if(EqualToPattern(name))
+    {
+        if(JoinPath(path, prefix, name))
+        {
+            IncreaseCounter(path, prefix + strlen(name));
+        }
+    }
+}
+
+#ifdef HAVE_URING
+static __thread Uring *ThreadRing;  //NULL in threads without a ring.
+
+void UringClose(Uring *ring)
+{
+    if(ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_bytes);
+    if(ring->cq_ring != MAP_FAILED)
+        munmap(ring->cq_ring, ring->cq_bytes);
+    if(ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_bytes);
+    close(ring->fd);
+}
+
+void UringFree(Uring *ring)
+{
+    free(ring->slots);
+    free(ring->free_slots);
+    free(ring->done_slots);
+    free(ring->stat_entries);
+    free(ring->stats);
+    free(ring->stat_results);
+    UringClose(ring);
+}
+
+/*
+ * Setting up a ring and mapping its queues. Returns False when the kernel doesn't let us.
+ */
+int UringSetup(Uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    if(ring->fd < 0)
+    {
+        return False;
+    }
+
+    ring->sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        UringClose(ring);
+        return False;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    ring->pending = 0;
+    return True;
+}
+
+/*
+ * Check once that the kernel has io_uring with openat and statx, 5.6 and up.
+ */
+int UringSupported()
+{
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    int supported = False;
+    Uring ring;
+
+    if(probe != NULL && UringSetup(&ring, 2))
+    {
+        supported = syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                    probe->ops_len > IORING_OP_STATX &&
+                    (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+        UringClose(&ring);
+    }
+    free(probe);
+    return supported;
+}
+
+/*
+ * Queueing an operation. The ring has room for every open and stat a thread has in flight,
+ * and the kernel only looks at the queue in UringEnter, so the tail can be published right away.
+ */
+struct io_uring_sqe *UringQueue(Uring *ring, int opcode, int fd, const void *addr, unsigned long long data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->user_data = data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
+
+/*
+ * Submitting the queued operations, and waiting for wait completions.
+ */
+void UringEnter(Uring *ring, unsigned wait)
+{
+    long ret;
+    do
+    {
+        ret = syscall(SYS_io_uring_enter, ring->fd, ring->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }while(ret < 0 && errno == EINTR);
+    if(ret < 0)
+    {
+        perror("Error in io_uring_enter");
+        exit(1);
+    }
+    ring->pending -= ret;
+}
+
+/*
+ * Taking all completions. An open fills its slot and a stat its result, they are used by whoever waits for them.
+ */
+void UringReap(Uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for(; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        if(cqe->user_data & URING_STAT)
+        {
+            ring->stat_results[cqe->user_data & ~URING_STAT] = cqe->res;
+            ring->stats_pending--;
+        }
+        else
+        {
+            ring->slots[cqe->user_data].result = cqe->res;
+            ring->done_slots[ring->done_count++] = cqe->user_data;
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Stating all entries without d_type deferred by ScanEntries in one batch, then scanning them.
+ * Entries whose stat failed go to ScanEntry without a type, which stats them again and reports it.
+ */
+void UringStatEntries(Uring *ring, int dir_fd, DirectoryNode *node, char *path, size_t prefix)
+{
+    if(ring->stat_count == 0)
+        return;
+
+    for(int i = 0; i < ring->stat_count; i++)
+    {
+        struct io_uring_sqe *sqe = UringQueue(ring, IORING_OP_STATX, dir_fd, ring->stat_entries[i]->d_name, URING_STAT | i);
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->len = STATX_TYPE;
+        sqe->off = (unsigned long)&ring->stats[i];
+    }
+    ring->stats_pending = ring->stat_count;
+    UringEnter(ring, 0);
+    UringReap(ring);
+    while(ring->stats_pending > 0)
+    {
+        UringEnter(ring, 1);
+        UringReap(ring);
+    }
+
+    for(int i = 0; i < ring->stat_count; i++)
+    {
+        unsigned char type = DT_UNKNOWN;
+        if(ring->stat_results[i] == 0)
+            type = S_ISDIR(ring->stats[i].stx_mode) ? DT_DIR : DT_REG;
+        ScanEntry(dir_fd, node, path, prefix, ring->stat_entries[i]->d_name, type);
+    }
+    ring->stat_count = 0;
+}
+
+/*
+ * Keeping an entry without d_type for the next batch of stats.
+ */
+void UringDeferEntry(Uring *ring, int dir_fd, DirectoryNode *node, char *path, size_t prefix, LinuxDirent *entry)
+{
+    if(ring->stat_count == UringDepth)
+        UringStatEntries(ring, dir_fd, node, path, prefix);
+    ring->stat_entries[ring->stat_count++] = entry;
+}
+#endif
+
+#ifdef SYS_getdents64
+static __thread char *DirentBuffer;
+
+/*
+ * Reading a directory with getdents64 into a big buffer of this thread, so a huge directory takes a few
+ * system calls. Entries are used in place, without copying their names.
+ */
+int ScanEntries(int dir_fd, DirectoryNode *node, char *path, size_t prefix)
+{
+    long got;
+
+    if(DirentBuffer == NULL)
+    {
+        DirentBuffer = malloc(DIRENT_BUFFER_BYTES);
+        if(DirentBuffer == NULL)
+        {
+            fprintf(stderr, "Error in allocating directory buffer.");
+            return False;
+        }
+    }
+
+    while((got = syscall(SYS_getdents64, dir_fd, DirentBuffer, DIRENT_BUFFER_BYTES)) > 0)
+    {
+        for(long offset = 0; offset < got; offset += ((LinuxDirent *)(DirentBuffer + offset))->d_reclen)
+        {
+            LinuxDirent *entry = (LinuxDirent *)(DirentBuffer + offset);
+#ifdef HAVE_URING
+            if(ThreadRing != NULL && entry->d_type == DT_UNKNOWN && !IgnoreFile(entry->d_name))
+            {
+                UringDeferEntry(ThreadRing, dir_fd, node, path, prefix, entry);
+                continue;
+            }
+#endif
+            ScanEntry(dir_fd, node, path, prefix, entry->d_name, entry->d_type);
+        }
+#ifdef HAVE_URING
+        if(ThreadRing != NULL)
+        {
+            UringStatEntries(ThreadRing, dir_fd, node, path, prefix); //Before the next getdents64 reuses the names.
+        }
+#endif
+    }
+    return got == 0;
+}
+#else
+/*
+ * Reading a directory with readdir, where getdents64 isn't available.
+ * readdir gets its own copy of dir_fd, since fstatat still needs it.
+ */
+int ScanEntries(int dir_fd, DirectoryNode *node, char *path, size_t prefix)
+{
+    struct dirent *entry = NULL;
+    DIR *dir = fdopendir(dup(dir_fd));
+
+    if(dir == NULL)
+    {
+        return False;
+    }
+    while((entry = readdir(dir)) != NULL)
+    {
+        ScanEntry(dir_fd, node, path, prefix, entry->d_name, entry->d_type);
+    }
+    closedir(dir);
+    return True;
+}
+#endif
+
+/*
+ * Starting the index record of a directory. For --refresh, a directory whose mtime didn't change
+ * gets its entries from the old index and isn't read, its subdirectories are still queued to be checked.
+ * Returns whether the directory has to be read.
+ */
+int IndexDirectory(int dir_fd, DirectoryNode *node, const char *directory, size_t length)
+{
+    struct stat info;
+    IndexCursor cursor;
+    long long mtime = 0;
+
+    if(fstat(dir_fd, &info) == 0)
+        mtime = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+    if(IndexMode == INDEX_REFRESH && mtime != 0 && IndexFind(&cursor, directory) && cursor.mtime == mtime)
+    {
+        IndexBeginDirectory(directory, length, mtime);
+        while(IndexNextEntry(&cursor))
+        {
+            IndexAddEntry(cursor.name, cursor.is_directory);
+            if(cursor.is_directory && length + 1 + cursor.name_length < PATH_MAX)
+                AddNewDirToQueue(node, cursor.name, cursor.name_length);
+        }
+        Deques[ThreadIndex].records.reused++;
+        return False;
+    }
+    IndexBeginDirectory(directory, length, mtime);
+    return True;
+}
+
+/*
+ * Watching a directory for --watch, before its entries are read, so no change after the read is missed.
+ * The watch is kept by this thread until WatchLoop takes it.
+ */
+void WatchDirectory(const char *directory)
+{
+    IndexBuffer *watches = &Deques[ThreadIndex].watches;
+    int wd = inotify_add_watch(WatchFd, directory, WATCH_MASK);
+
+    if(wd < 0)
+    {
+        if(errno != ENOSPC)
+            fprintf(stderr, "Couldn't watch %s.\n", directory);
+        else if(!__atomic_exchange_n(&WatchesExhausted, True, __ATOMIC_RELAXED))
+            fprintf(stderr, "Out of inotify watches, raise fs.inotify.max_user_watches.\n");
+        return;
+    }
+    IndexAppend(watches, &wd, sizeof(wd));
+    IndexAppend(watches, directory, strlen(directory) + 1);
+}
+
+/*
+ * Scanning a directory opened at dir_fd. A negative dir_fd is reported with errno.
+ */
+int ScanOpenedDirectory(int dir_fd, DirectoryNode *node, const char *directory, size_t prefix)
+{
+    char path[PATH_MAX];
+
+    if(dir_fd < 0){
+        if(errno == EACCES)
+        {
+            fprintf(stderr, CONTINUE_MSG, directory);
+            return True;
+        }
+        if(Rescanning && (errno == ENOENT || errno == ENOTDIR))
+        {
+            return True; //Removed again before --watch got to it.
+        }
+        fprintf(stderr, "Couldn't open %s.\n", directory);
+        return False;
+    }
+
+    if((IndexMode == INDEX_BUILD || IndexMode == INDEX_REFRESH) && !IndexDirectory(dir_fd, node, directory, prefix))
+    {
+        close(dir_fd);
+        return True;
+    }
+
+    if(WatchFd >= 0)
+    {
+        WatchDirectory(directory);
+    }
+
+    memcpy(path, directory, prefix);
+    if(prefix == 0 || path[prefix - 1] != '/')
+        path[prefix++] = '/';
+
+    if(!ScanEntries(dir_fd, node, path, prefix))
+    {
+        fprintf(stderr, "Couldn't read %s.\n", directory);
+    }
+    close(dir_fd);
+    return True; //Only a directory we can't open is an error, empty ones are not.
+}
+
+/*
+ * Scanning current directory content.
+ */
+int ScanDirectory(DirectoryNode *node)
+{
+    char directory[PATH_MAX];
+    size_t prefix = BuildPath(node, directory);
+
+    if(prefix == 0)
+    {
+        fprintf(stderr, "Path too long under %s.\n", node->name);
+        return True;
+    }
+    return ScanOpenedDirectory(openat(AT_FDCWD, directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC), node, directory, prefix);
+}
+
+/*
+ * Stopping this thread after an error.
+ * Its queue may still hold directories, so a sleeping thread is woken to take them.
+ */
+void StopOnError()
+{
+    pthread_mutex_lock(&park_lock);
+    ThreadErrorsCounter++;
+    if(!DequeEmpty(&Deques[ThreadIndex]))
+    {
+        Wakeup();
+    }
+    pthread_mutex_unlock(&park_lock);
+}
+
+/*
+ * Releasing a scanned directory and counting it as done. Returns False when its scan failed.
+ */
+int FinishScan(DirectoryNode *node, int scanned)
+{
+    ReleaseNode(node);
+    if(!scanned)
+    {
+        StopOnError();
+    }
+    FinishDirectory();
+    return scanned;
+}
+
+/*
+ * The loop will try:
+ *  - Try to take a directory from its own queue, or steal one.
+ *  - Scan directory.
+ *  - Print matching patterns.
+ * It returns when the search is over, or after an error.
+ */
+void SearchLoop()
+{
+    while(True)
+    {
+        DirectoryNode *node = RemoveDirFromQueue();
+        if(node == NULL)
+        {
+            if(!WaitForData())
+                break;
+            continue;
+        }
+
+        if(!FinishScan(node, ScanDirectory(node)))
+        {
+            break;
+        }
+    }
+}
+
+#ifdef HAVE_URING
+/*
+ * Queueing the open of a directory on a free slot. Returns False when there was nothing to open.
  */
-int DirectorySearchable(char *path)
+int UringOpen(Uring *ring, DirectoryNode *node)
 {
-    DIR *dir = opendir(path);
-    if(!dir)
-    {
-        return 0;
-    }
-    else
+    int index = ring->free_slots[--ring->free_count];
+    UringSlot *slot = &ring->slots[index];
+
+    slot->node = node;
+    slot->prefix = BuildPath(node, slot->directory);
+    if(slot->prefix == 0)
     {
-        closedir(dir);
-        return 1;
+        fprintf(stderr, "Path too long under %s.\n", node->name);
+        ring->free_slots[ring->free_count++] = index;
+        FinishScan(node, True);
+        return False;
     }
+    struct io_uring_sqe *sqe = UringQueue(ring, IORING_OP_OPENAT, AT_FDCWD, slot->directory, index);
+    sqe->open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    return True;
 }
 
 /*
- * Adding directory to queue.
- * Because it is FIFO we will elements to the end of the queue.
+ * Search loop of a thread with a ring. Up to UringDepth opens are kept in flight, and every directory is
+ * scanned as soon as its open completes, which queues more directories to open.
+ * Only the first directory may be stolen, the rest come from the thread's own queue.
+ * Returns False when the ring couldn't be set up, and the thread searches without it.
  */
-int AddNewDirToQueue(char* queueDirectory)
+int UringLoop()
 {
-    pthread_mutex_lock(&queue_lock);
-    DirectoryNode *node = malloc(sizeof(DirectoryNode));
-    if(node == NULL) {
-        fprintf(stderr, "Error in allocating memory for Node.");
-        pthread_mutex_unlock(&queue_lock);
+    Deque *self = &Deques[ThreadIndex];
+    int inflight = 0, failed = False;
+    Uring ring;
+
+    if(!UringSetup(&ring, UringDepth * 2))
+    {
         return False;
     }
-
-    strcpy(node -> directory, queueDirectory);
-    node -> next = NULL;
-
-    if((WorkingQueue.head) == NULL &&  (WorkingQueue.tail) == NULL)
+    ring.slots = malloc(UringDepth * sizeof(UringSlot));
+    ring.free_slots = malloc(UringDepth * sizeof(int));
+    ring.done_slots = malloc(UringDepth * sizeof(int));
+    ring.stat_entries = malloc(UringDepth * sizeof(LinuxDirent *));
+    ring.stats = malloc(UringDepth * sizeof(struct statx));
+    ring.stat_results = malloc(UringDepth * sizeof(int));
+    if(ring.slots == NULL || ring.free_slots == NULL || ring.done_slots == NULL || ring.stat_entries == NULL ||
+       ring.stats == NULL || ring.stat_results == NULL)
     {
-        //First element of the queue.
-        WorkingQueue.head = WorkingQueue.tail = node;
+        UringFree(&ring);
+        return False;
     }
-    else
+    for(int i = 0; i < UringDepth; i++)
+    {
+        ring.free_slots[i] = i;
+    }
+    ring.free_count = UringDepth;
+    ring.done_count = 0;
+    ring.stat_count = 0;
+    ThreadRing = &ring;
+
+    while(True)
     {
-        WorkingQueue.tail -> next = node;
-        WorkingQueue.tail = node;
+        while(!failed && inflight < UringDepth)
+        {
+            DirectoryNode *node = inflight == 0 ? RemoveDirFromQueue() : PopDirectory(self);
+            if(node == NULL)
+                break;
+            inflight += UringOpen(&ring, node);
+        }
+        if(inflight == 0)
+        {
+            if(failed || !WaitForData())
+                break;
+            continue;
+        }
+
+        UringEnter(&ring, 1);
+        UringReap(&ring);
+        //Scanning may reap more opens, they are taken by this loop too.
+        while(ring.done_count > 0)
+        {
+            UringSlot *slot = &ring.slots[ring.done_slots[--ring.done_count]];
+            ring.free_slots[ring.free_count++] = slot - ring.slots;
+            inflight--;
+            errno = -slot->result;
+            if(!FinishScan(slot->node, ScanOpenedDirectory(slot->result, slot->node, slot->directory, slot->prefix)))
+            {
+                failed = True; //Opens in flight are still scanned, then the thread stops.
+            }
+        }
     }
 
-    WorkingQueue.length += 1;
-    pthread_mutex_unlock(&queue_lock);
+    ThreadRing = NULL;
+    UringFree(&ring);
     return True;
 }
+#endif
 
 /*
- * Count thread as working thread.
+ * Searching an index instead of the file system. Threads take blocks in turns until none are left.
  */
-void Wakeup()
+void QueryLoop()
 {
-    pthread_mutex_lock(&sleep_thread_lock);
-    SleepThreads--;
-    pthread_mutex_unlock(&sleep_thread_lock);
-}
+    IndexCursor cursor;
+    char path[PATH_MAX];
+    long block;
 
-/*
- * Kill all threads.
- */
-void KillAll()
-{
-    sleep(0);
-    for(int i=0; i<NumberOfThreads; i++)
+    while((block = __atomic_fetch_add(&NextBlock, 1, __ATOMIC_RELAXED)) < (long)Index->blocks)
     {
-        pthread_cancel(ThreadList[i]);
+        IndexOpenBlock(&cursor, block);
+        while(IndexNextDirectory(&cursor))
+        {
+            size_t prefix = cursor.path_length;
+            memcpy(path, cursor.path, prefix);
+            if(prefix == 0 || path[prefix - 1] != '/')
+                path[prefix++] = '/';
+            while(IndexNextEntry(&cursor))
+            {
+                if(!cursor.is_directory && EqualToPattern(cursor.name) && JoinPath(path, prefix, cursor.name))
+                {
+                    IncreaseCounter(path, prefix + cursor.name_length);
+                }
+            }
+        }
     }
 }
 
 /*
- * Count dormant threads. Send kill command if needed.
+ * Thread body. Threads use a ring with --uring, unless this kernel or process doesn't allow one.
  */
-void GetDormantThreadsAndKill()
+void *ThreadLoop(void *num)
 {
-    sleep(0);
-    pthread_mutex_lock(&sleep_thread_lock);
-    pthread_mutex_lock(&dead_thread_lock);
-    int total_dormant = ThreadErrorsCounter + SleepThreads;
-    pthread_mutex_unlock(&sleep_thread_lock);
-    pthread_mutex_unlock(&dead_thread_lock);
+    ThreadIndex = (long)num;
 
-    if(total_dormant>NumberOfThreads)
+    if(IndexMode == INDEX_QUERY)
+    {
+        QueryLoop();
+    }
+    else
     {
-        KillAll();
+#ifdef HAVE_URING
+        if(UringDepth == 0 || !UringLoop())
+#endif
+        SearchLoop();
     }
+
+    FlushOutput();
+#ifdef SYS_getdents64
+    free(DirentBuffer);
+#endif
+    return NULL;
 }
 
 /*
- * Count thread as sleep.
+ * Initiating all threads and waiting for the search to end.
+ * Every thread has its queue before it starts, so threads start searching right away.
+ * Without io_uring, --uring falls back to the threads alone.
  */
-void Sleep()
+void Run()
 {
-    pthread_mutex_lock(&sleep_thread_lock);
-    SleepThreads++;
-    pthread_mutex_unlock(&sleep_thread_lock);
+#ifdef HAVE_URING
+    if(UringDepth > 0 && !UringSupported())
+#else
+    if(UringDepth > 0)
+#endif
+    {
+        fprintf(stderr, "io_uring is unavailable, searching with threads only.\n");
+        UringDepth = 0;
+    }
+
+    for(long i = 0; i < NumberOfThreads; i++)
+    {
+        if(pthread_create(&ThreadList[i], NULL, ThreadLoop, (void *)i))
+        {
+            fprintf(stderr, "Error in creating thread.");
+            pthread_mutex_lock(&park_lock); //Started threads may be failing too.
+            ThreadErrorsCounter++;
+            pthread_mutex_unlock(&park_lock);
+        }
+        else
+        {
+            ThreadStarted[i] = True;
+        }
+    }
+
+    for(int i = 0; i < NumberOfThreads; i++)
+    {
+        if(ThreadStarted[i])
+        {
+            pthread_join(ThreadList[i], NULL);
+        }
+    }
 }
 
+
 /*
- * Making thread to sleep.
+ * -----Watch-------
  */
-void WaitForData()
+static size_t HashPath(const char *path)
 {
-    GetDormantThreadsAndKill();
-
-    //Waiting for signal.
-    pthread_mutex_lock(&queue_lock);
-    pthread_cond_wait(&queue_not_empty, &queue_lock);
-    pthread_mutex_unlock(&queue_lock);
+    size_t hash = 0xcbf29ce484222325UL;
+    for(; *path != '\0'; path++)
+    {
+        hash ^= (unsigned char)*path;
+        hash *= 0x100000001b3UL;
+    }
+    return hash;
 }
 
+static char RemovedMatch[1];    //Marks a removed slot, so lookups go past it.
+
 /*
- * Removing directory from queue.
- * Because it is FIFO we will remove the first element.
+ * Finding the slot of a match in a set of size slots. Returns its slot, or the free slot it would take.
  */
-void RemoveDirFromQueue(char *nexDirectory)
+static size_t FindMatchIn(char **set, size_t size, const char *path)
 {
-    DirectoryNode *head = WorkingQueue.head;
-    DirectoryNode *second = head -> next;
-    if(head->directory != NULL)
-        strcpy(nexDirectory, head->directory);
-    WorkingQueue.head = second;
-    if(WorkingQueue.head == NULL)
+    size_t mask = size - 1;
+    size_t i = HashPath(path) & mask;
+    size_t removed = size;
+
+    for(; set[i] != NULL; i = (i + 1) & mask)
     {
-        //We reached final element.
-        WorkingQueue.tail = WorkingQueue.head;
+        if(set[i] == RemovedMatch)
+        {
+            removed = removed == size ? i : removed;
+        }
+        else if(strcmp(set[i], path) == 0)
+        {
+            return i;
+        }
     }
-    free(head);
+    return removed != size ? removed : i;
+}
 
-    WorkingQueue.length -= 1;
-    pthread_mutex_unlock(&queue_lock);
+static size_t FindMatch(const char *path)
+{
+    return FindMatchIn(Matches, MatchesSize, path);
 }
 
 /*
- * If pattern was found we increasing our counter.
+ * Checking whether a set of size slots holds a match.
  */
-void IncreaseCounter()
+static int KnownMatch(char **set, size_t size, const char *path)
 {
-    pthread_mutex_lock(&counter_lock);
-    PatternCounter++;
-    pthread_mutex_unlock(&counter_lock);
+    if(size == 0)
+        return False;
+    size_t i = FindMatchIn(set, size, path);
+    return set[i] != NULL && set[i] != RemovedMatch;
 }
 
 /*
- * Initiating all relevant data structures for start working.
+ * Making room for one more match. The set is at most half full, removed slots included.
  */
-void Init(int argc, char *argv[])
+static void ReserveMatch()
 {
-    //Check args.
-    if(argc != 4)
+    char **old = Matches;
+    size_t old_size = MatchesSize;
+
+    if((MatchesUsed + 1) * 2 <= MatchesSize)
+        return;
+    MatchesSize = INITIAL_MATCHES_SIZE;
+    while(MatchesSize < (MatchesLive + 1) * 4)
+        MatchesSize *= 2;
+    Matches = calloc(MatchesSize, sizeof(char *));
+    if(Matches == NULL)
     {
-        fprintf(stderr,"Error in the number of arguments");
+        fprintf(stderr, "Error in allocating matches.\n");
         exit(1);
     }
-
-    //Init counter.
-    PatternCounter = 0;
-    SleepThreads = 0;
-    ThreadErrorsCounter = 0;
-    TotalOpened = 0;
-
-    //Adding root to queue.
-    if (DirectorySearchable(argv[1])) {
-        AddNewDirToQueue(argv[1]);
-    }
-    else
+    MatchesUsed = MatchesLive;
+    for(size_t i = 0; i < old_size; i++)
     {
-        fprintf(stderr, "Root is not searchable.\n");
-        exit(1);
+        if(old[i] != NULL && old[i] != RemovedMatch)
+            Matches[FindMatch(old[i])] = old[i];
     }
+    free(old);
+}
 
-    //Init fields.
-    Pattern = argv[2];
-    NumberOfThreads = atoi(argv[3]);
-    ThreadList = malloc(NumberOfThreads * sizeof(pthread_t));
-    if(ThreadList == NULL)
+/*
+ * Adding a match. Returns False when it was known.
+ */
+int AddMatch(const char *path)
+{
+    ReserveMatch();
+    size_t i = FindMatch(path);
+    if(Matches[i] != NULL && Matches[i] != RemovedMatch)
+        return False;
+    if(Matches[i] == NULL)
+        MatchesUsed++;
+    Matches[i] = strdup(path);
+    if(Matches[i] == NULL)
     {
-        fprintf(stderr, "Error in list allocation.");
+        fprintf(stderr, "Error in allocating matches.\n");
         exit(1);
     }
+    MatchesLive++;
+    return True;
 }
 
 /*
- * Check if we need to ignore file.
+ * Removing a match. Returns False when it wasn't known.
  */
-int IgnoreFile(char *file)
+int RemoveMatch(const char *path)
 {
-    return (strcmp(file, ".") == 0) || (strcmp(file, "..") == 0);
+    size_t i = MatchesSize == 0 ? 0 : FindMatch(path);
+    if(MatchesSize == 0 || Matches[i] == NULL || Matches[i] == RemovedMatch)
+        return False;
+    free(Matches[i]);
+    Matches[i] = RemovedMatch;
+    MatchesLive--;
+    return True;
 }
 
 /*
- * Check if the path is the desired pattern.
+ * Writing one change as "+ path" or "- path" into lines.
  */
-int EqualToPattern(char *path)
+void AnnounceChange(IndexBuffer *lines, const char *sign, const char *path)
 {
-    return strstr(path,Pattern) != NULL;
+    IndexAppend(lines, sign, 2);
+    IndexAppend(lines, path, strlen(path));
+    IndexAppend(lines, "\n", 1);
 }
 
 /*
- * Scanning current directory content.
+ * Scanning the whole tree again after the inotify queue overflowed. Events were lost, so the known matches
+ * and watches are put aside, and the scan builds them again. CollectScan tells the differences.
+ * Returns whether the root was queued.
  */
-int ScanDirectory(const char *directory)
+int Resynchronize()
 {
-    struct dirent *entry = NULL;
-    struct stat f_info;
-    char path[PATH_MAX];
-    char file_name[FILENAME_MAX];
-    int ret = False;
-    DIR *dir = opendir(directory);
-
-    if(dir == NULL){
-        fprintf(stderr, "Couldn't open %s.\n", directory);
-        return False;
-    }
-    if(errno == EACCES){
-        fprintf(stderr, CONTINUE_MSG, directory);
+    fprintf(stderr, "Too many changes at once, scanning %s again.\n", IndexRoot);
+    if(!AddNewDirToQueue(NULL, IndexRoot, strlen(IndexRoot)))
         return False;
-    }
+    Resyncing = True;
+    StaleMatches = Matches;
+    StaleMatchesSize = MatchesSize;
+    StaleWatchPaths = WatchPaths;
+    StaleWatchPathsSize = WatchPathsSize;
+    Matches = NULL;
+    MatchesSize = MatchesUsed = MatchesLive = 0;
+    WatchPaths = NULL;
+    WatchPathsSize = 0;
+    return True;
+}
 
-    while((entry = readdir(dir)) != NULL)
+/*
+ * Ending a rescan of the whole tree: matches it didn't find again are announced as removed, and watches
+ * of directories it didn't find again are dropped.
+ */
+void FinishResync(IndexBuffer *lines)
+{
+    for(size_t i = 0; i < StaleMatchesSize; i++)
     {
-        strcpy(path, directory);
-        if(path[strlen(path) -1] != '/')
-            strcat(path, "/");
-
-        strcpy(file_name, entry->d_name);
-        if(IgnoreFile(file_name))
+        if(StaleMatches[i] == NULL || StaleMatches[i] == RemovedMatch)
             continue;
+        if(!KnownMatch(Matches, MatchesSize, StaleMatches[i]))
+            AnnounceChange(lines, "- ", StaleMatches[i]);
+        free(StaleMatches[i]);
+    }
+    for(int wd = 0; wd < StaleWatchPathsSize; wd++)
+    {
+        if(StaleWatchPaths[wd] == NULL)
+            continue;
+        //A directory found again got the same watch descriptor back.
+        if(wd >= WatchPathsSize || WatchPaths[wd] == NULL)
+            inotify_rm_watch(WatchFd, wd);
+        free(StaleWatchPaths[wd]);
+    }
+    free(StaleMatches);
+    free(StaleWatchPaths);
+    StaleMatches = NULL;
+    StaleWatchPaths = NULL;
+    StaleMatchesSize = 0;
+    StaleWatchPathsSize = 0;
+    Resyncing = False;
+}
 
-        //Adding new file full path.
-        strcat(path, entry->d_name);
-
-        if(lstat(path, &f_info) == -1)
+/*
+ * Taking the watches and the matches of all threads after a scan. Matches of the first scan were printed
+ * by the scan, later ones are announced here when they are new.
+ */
+void CollectScan(IndexBuffer *lines)
+{
+    for(int i = 0; i < NumberOfThreads; i++)
+    {
+        IndexBuffer *watches = &Deques[i].watches;
+        for(size_t offset = 0; offset < watches->length; )
         {
-            fprintf(stderr, "Unable get %s status.\n", path);
-            ret = False;
-        }
+            int wd;
+            memcpy(&wd, watches->buffer + offset, sizeof(wd));
+            char *directory = watches->buffer + offset + sizeof(wd);
+            offset += sizeof(wd) + strlen(directory) + 1;
 
-        if(S_ISDIR(f_info.st_mode))
-        {
-            AddNewDirToQueue(entry->d_name);
-            pthread_cond_broadcast(&queue_not_empty);
-            ret = True;
+            if(wd >= WatchPathsSize)
+            {
+                int size = WatchPathsSize * 2 > wd ? WatchPathsSize * 2 : wd + 1024;
+                char **grown = realloc(WatchPaths, size * sizeof(char *));
+                if(grown == NULL)
+                {
+                    fprintf(stderr, "Error in allocating watches.\n");
+                    exit(1);
+                }
+                memset(grown + WatchPathsSize, 0, (size - WatchPathsSize) * sizeof(char *));
+                WatchPaths = grown;
+                WatchPathsSize = size;
+            }
+            //A directory found again, after a move, keeps its watch descriptor.
+            free(WatchPaths[wd]);
+            WatchPaths[wd] = strdup(directory);
         }
+        watches->length = 0;
 
-        else
+        IndexBuffer *found = &Deques[i].found;
+        for(size_t offset = 0; offset < found->length; offset += strlen(found->buffer + offset) + 1)
         {
-            if(EqualToPattern(entry->d_name))
-            {
-                printf("%s\n", path);
-                IncreaseCounter();
-            }
-            ret = True;
+            if(AddMatch(found->buffer + offset) && Rescanning &&
+               !KnownMatch(StaleMatches, StaleMatchesSize, found->buffer + offset))
+                AnnounceChange(lines, "+ ", found->buffer + offset);
         }
+        found->length = 0;
     }
-
-    closedir(dir);
-    return ret;
+    if(Resyncing)
+        FinishResync(lines);
 }
 
 /*
- * Kill thread for receiving error.
+ * Forgetting a directory that was removed or moved away: its matches are announced as removed, and
+ * its watches and those under it are dropped. A deleted directory lost its entries one event at a time.
  */
-void KillOnError()
+void ForgetDirectory(IndexBuffer *lines, const char *directory)
 {
-    sleep(0);
-    pthread_mutex_lock(&dead_thread_lock);
-    ThreadErrorsCounter++;
-    pthread_mutex_unlock(&dead_thread_lock);
-    GetDormantThreadsAndKill();
-    pthread_exit(NULL);
+    size_t length = strlen(directory);
+
+    for(size_t i = 0; i < MatchesSize; i++)
+    {
+        if(Matches[i] != NULL && Matches[i] != RemovedMatch &&
+           strncmp(Matches[i], directory, length) == 0 && Matches[i][length] == '/')
+        {
+            AnnounceChange(lines, "- ", Matches[i]);
+            free(Matches[i]);
+            Matches[i] = RemovedMatch;
+            MatchesLive--;
+        }
+    }
+    for(int wd = 0; wd < WatchPathsSize; wd++)
+    {
+        if(WatchPaths[wd] != NULL && strncmp(WatchPaths[wd], directory, length) == 0 &&
+           (WatchPaths[wd][length] == '/' || WatchPaths[wd][length] == '\0'))
+        {
+            inotify_rm_watch(WatchFd, wd);
+            free(WatchPaths[wd]);
+            WatchPaths[wd] = NULL;
+        }
+    }
 }
 
 /*
- * Return true if is empty.
+ * Handling one event. New directories are queued, to be scanned together after the other events.
+ * Returns whether one was queued. After an overflow the whole tree is queued, and the events left in
+ * the batch are ignored, since the scan sees their changes.
  */
-int IsEmpty()
+int HandleEvent(IndexBuffer *lines, struct inotify_event *event)
 {
-    pthread_mutex_lock(&queue_lock);
-    int length = WorkingQueue.length==0;
-    pthread_mutex_unlock(&queue_lock);
-    return length;
-}
+    char path[PATH_MAX];
 
-void WaitForAllStart()
-{
-    pthread_mutex_lock(&thread_lock);
-    TotalOpened++;
-    pthread_mutex_unlock(&thread_lock);
-    pthread_mutex_lock(&start_all_lock);
-    pthread_cond_wait(&start_search, &start_all_lock);
-    pthread_mutex_unlock(&start_all_lock);
-}
+    if(Resyncing)
+    {
+        return False;
+    }
+    if(event->mask & IN_Q_OVERFLOW)
+    {
+        return Resynchronize();
+    }
+    if(event->wd < 0 || event->wd >= WatchPathsSize || WatchPaths[event->wd] == NULL)
+    {
+        return False;
+    }
+    if(event->mask & IN_IGNORED)
+    {
+        free(WatchPaths[event->wd]);
+        WatchPaths[event->wd] = NULL;
+        return False;
+    }
+    if(event->len == 0)
+    {
+        return False;
+    }
 
-/*
- * The loop will try:
- *  - Try to dequeue element.
- *  - Scan directory.
- *  - Print matching patterns.
- */
-void *ThreadLoop(void *num)
-{
-    WaitForAllStart();
+    size_t prefix = strlen(WatchPaths[event->wd]);
+    memcpy(path, WatchPaths[event->wd], prefix);
+    if(prefix == 0 || path[prefix - 1] != '/')
+        path[prefix++] = '/';
+    if(!JoinPath(path, prefix, event->name))
+    {
+        return False;
+    }
 
-    while(True)
+    if(event->mask & IN_ISDIR)
     {
-        if(IsEmpty())
+        if(event->mask & (IN_DELETE | IN_MOVED_FROM))
         {
-            WaitForData();
+            ForgetDirectory(lines, path);
+            return False;
         }
-
-        Wakeup();
-        char directory[PATH_MAX];
-        pthread_mutex_lock(&queue_lock);
-        RemoveDirFromQueue(directory);
-        pthread_mutex_unlock(&queue_lock);
-        ScanDirectory(directory) ? Sleep() : KillOnError();
+        return AddNewDirToQueue(NULL, path, strlen(path));
+    }
+    if(!EqualToPattern(event->name))
+    {
+        return False;
+    }
+    if((event->mask & (IN_CREATE | IN_MOVED_TO)) && AddMatch(path))
+    {
+        AnnounceChange(lines, "+ ", path);
+    }
+    else if((event->mask & (IN_DELETE | IN_MOVED_FROM)) && RemoveMatch(path))
+    {
+        AnnounceChange(lines, "- ", path);
     }
+    return False;
+}
+
+static void StopWatching(int signal)
+{
+    Stopping = True;
 }
 
 /*
- * Initiating all threads.
+ * Keeping the results live after the first search, until SIGINT or SIGTERM. Changes are printed as
+ * "+ path" and "- path" after every batch of events. New directories are scanned by all threads,
+ * which watch them too.
  */
-void Run()
+void WatchLoop()
 {
-    for(long i = 0; i < NumberOfThreads; i++)
+    char events[WATCH_BUFFER_BYTES] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct sigaction action;
+    struct pollfd watch = {.fd = WatchFd, .events = POLLIN};
+    sigset_t stop, waiting;
+    IndexBuffer lines = {0};
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = StopWatching;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    //The signals stay blocked outside ppoll(), so one that comes after the Stopping check ends the wait.
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, &waiting);
+    sigdelset(&waiting, SIGINT);
+    sigdelset(&waiting, SIGTERM);
+
+    ThreadIndex = 0;
+    Rescanning = True;
+    while(!Stopping)
     {
-        if(pthread_create(&ThreadList[i], NULL, ThreadLoop, (void *)i))
+        int ready = ppoll(&watch, 1, NULL, &waiting);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready < 0)
         {
-            fprintf(stderr, "Error in creating thread.");
-            pthread_mutex_lock(&counter_lock);
-            ThreadErrorsCounter++;
-            pthread_mutex_unlock(&counter_lock);
+            perror("Error in waiting for events");
+            break;
+        }
+        ssize_t got = read(WatchFd, events, sizeof(events));
+        if(got < 0 && errno == EINTR)
+            continue;
+        if(got <= 0)
+        {
+            perror("Error in reading events");
+            break;
+        }
+
+        int queued = False;
+        for(char *at = events; at < events + got; at += sizeof(struct inotify_event) + ((struct inotify_event *)at)->len)
+        {
+            queued |= HandleEvent(&lines, (struct inotify_event *)at);
+        }
+        if(queued)
+        {
+            SearchDone = False;
+            SleepThreads = WakeupsPending = 0;
+            memset(ThreadStarted, 0, NumberOfThreads);
+            Run();
+            CollectScan(&lines);
         }
+        WriteAll(lines.buffer, lines.length);
+        lines.length = 0;
     }
+    pthread_sigmask(SIG_UNBLOCK, &stop, NULL);
+    free(lines.buffer);
+}
 
-    SleepThreads = NumberOfThreads - ThreadErrorsCounter;
-    while(True)
+void FreeWatches()
+{
+    for(int wd = 0; wd < WatchPathsSize; wd++)
+        free(WatchPaths[wd]);
+    for(size_t i = 0; i < MatchesSize; i++)
     {
-        if(TotalOpened>=NumberOfThreads)
-            break;
+        if(Matches[i] != RemovedMatch)
+            free(Matches[i]);
     }
-
-    pthread_mutex_lock(&thread_lock);
-    pthread_cond_broadcast(&start_search);
-    pthread_mutex_unlock(&thread_lock);
+    free(WatchPaths);
+    free(Matches);
+    close(WatchFd);
 }
 
-
 /*
  * Starting this session locks and conditionals.
  */
 void StartLocksAndConditionals()
 {
-    int rc = pthread_mutex_init(&queue_lock, NULL) || pthread_mutex_init(&sleep_thread_lock,NULL)
-            || pthread_mutex_init(&dead_thread_lock, NULL) || pthread_mutex_init(&counter_lock,NULL) ||
-            pthread_mutex_init(&thread_lock, NULL) || pthread_mutex_init(&start_all_lock, NULL);
+    int rc = pthread_mutex_init(&park_lock, NULL) || pthread_mutex_init(&output_lock, NULL);
     if(rc)
     {
         fprintf(stderr, "Error in pthread_mutex_init()");
         exit(-1);
     }
 
-    rc = pthread_cond_init(&queue_not_empty, NULL) || pthread_cond_init(&start_search, NULL);
+    rc = pthread_cond_init(&work_available, NULL);
     if(rc)
     {
         fprintf(stderr, "Error in pthread_cond_init()");
@@ -423,15 +2829,10 @@ void StartLocksAndConditionals()
  */
 void CleanLocksAndConditionals()
 {
-    pthread_mutex_destroy(&queue_lock);
-    pthread_mutex_destroy(&counter_lock);
-    pthread_mutex_destroy(&dead_thread_lock);
-    pthread_mutex_destroy(&sleep_thread_lock);
-    pthread_mutex_destroy(&thread_lock);
-    pthread_mutex_destroy(&start_all_lock);
+    pthread_mutex_destroy(&park_lock);
+    pthread_mutex_destroy(&output_lock);
 
-    pthread_cond_destroy(&queue_not_empty);
-    pthread_cond_destroy(&start_search);
+    pthread_cond_destroy(&work_available);
 }
 
 /*
@@ -439,7 +2840,45 @@ void CleanLocksAndConditionals()
  */
 void FreeAllMemory()
 {
+    for(int i=0; i<NumberOfThreads; i++)
+    {
+        //Directories left by a thread that failed are freed with their deque.
+        for(long j = Deques[i].top; j < Deques[i].bottom; j++)
+        {
+            ReleaseNode(DequeItem(Deques[i].array, j));
+        }
+        if(Deques[i].chunk != NULL)
+        {
+            ReleaseChunk(Deques[i].chunk);
+        }
+        free(Deques[i].output.buffer);
+        free(Deques[i].records.buffer);
+        free(Deques[i].watches.buffer);
+        free(Deques[i].found.buffer);
+        DequeArray *array = Deques[i].array;
+        while(array != NULL)
+        {
+            DequeArray *previous = array->previous;
+            free(array);
+            array = previous;
+        }
+    }
+    free(Deques);
+    free(ThreadStarted);
     free(ThreadList);
+    if(IndexMode == INDEX_BUILD)
+    {
+        free(IndexRoot);
+    }
+    if(Index != NULL)
+    {
+        munmap(Index, IndexBytes);
+    }
+    if(WatchFd >= 0)
+    {
+        FreeWatches();
+    }
+    FreePatterns();
     CleanLocksAndConditionals();
 }
 
@@ -448,6 +2887,48 @@ int main(int argc, char *argv[])
     StartLocksAndConditionals();
     Init(argc,argv);
     Run();
+    if(IndexMode == INDEX_BUILD || IndexMode == INDEX_REFRESH)
+    {
+        //A failed scan misses directories, so the old index is better than a new one.
+        long long directories = 0, entries = 0, reused = 0;
+        for(int i=0; i<NumberOfThreads; i++)
+        {
+            directories += Deques[i].records.directories;
+            entries += Deques[i].records.entries;
+            reused += Deques[i].records.reused;
+        }
+        if(ThreadErrorsCounter == 0)
+        {
+            WriteIndex(IndexFile, IndexRoot);
+            if(IndexMode == INDEX_BUILD)
+                printf(INDEX_MSG, directories, entries, IndexRoot);
+            else
+                printf(REFRESH_MSG, directories, entries, IndexRoot, directories - reused);
+        }
+        else
+        {
+            fprintf(stderr, "Index %s was not written, the scan failed.\n", IndexFile);
+        }
+        FreeAllMemory();
+        return ThreadErrorsCounter > 0;
+    }
+    if(Sorted)
+    {
+        WriteSortedOutput();
+    }
+    for(int i=0; i<NumberOfThreads; i++)
+    {
+        PatternCounter += Deques[i].output.matches;
+    }
+    if(WatchFd >= 0)
+    {
+        printf(EXIT_MSG, PatternCounter);
+        fflush(stdout);
+        CollectScan(NULL);
+        WatchLoop();
+        FreeAllMemory();
+        return ThreadErrorsCounter > 0;
+    }
     FreeAllMemory();
     printf(EXIT_MSG, PatternCounter);
     return ThreadErrorsCounter > 0;
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ftw.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Scaling benchmark for pfind. Runs pfind on one tree with 1, 2, 4, ... threads and reports the best wall
+ * time of every thread count, its speedup over one thread and the number of matches, which must not change.
+ * Without a root, a wide synthetic tree is generated under /tmp and removed at the end.
+ * -u also runs pfind --uring=depth with every thread count, next to the threads alone.
+ * -c drops the page, dentry and inode caches before every run, which needs root. Without it, runs are warm.
+ *
+ * Build: gcc -O2 -Wall -std=gnu11 -pthread pfind.c -o pfind && gcc -O2 -Wall -std=gnu11 pfind_bench.c -o pfind_bench
+ * Usage: ./pfind_bench [-p pfind] [-t max threads] [-r runs] [-g depth:fanout:files] [-u depth] [-c] [root] [pattern]
+ */
+
+#define DEFAULT_PFIND "./pfind"
+#define DEFAULT_MAX_THREADS 64
+#define DEFAULT_RUNS 3
+#define DEFAULT_PATTERN ".c"
+#define OUTPUT_CHUNK 65536
+
+char *PfindPath = DEFAULT_PFIND;
+int MaxThreads = DEFAULT_MAX_THREADS;
+int Runs = DEFAULT_RUNS;
+int TreeDepth = 4;
+int TreeFanout = 10;
+int TreeFiles = 20;
+int UringDepth = 0;
+int ColdCache = 0;
+
+double NowSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Directories fanout wide and depth deep, every one with files files. Every other file matches ".c".
+ */
+void GenerateTree(char *path, int depth)
+{
+    char child[PATH_MAX];
+    int file_desc;
+
+    if(mkdir(path, 0755) < 0 && errno != EEXIST)
+    {
+        perror("Error in creating tree");
+        exit(1);
+    }
+    for(int i = 0; i < TreeFiles; i++)
+    {
+        snprintf(child, sizeof(child), "%s/file%d.%s", path, i, i % 2 ? "c" : "o");
+        file_desc = open(child, O_WRONLY | O_CREAT, 0644);
+        if(file_desc < 0)
+        {
+            perror("Error in creating tree");
+            exit(1);
+        }
+        close(file_desc);
+    }
+    for(int i = 0; depth > 0 && i < TreeFanout; i++)
+    {
+        snprintf(child, sizeof(child), "%s/dir%d", path, i);
+        GenerateTree(child, depth - 1);
+    }
+}
+
+/*
+ * Dropping the caches, so the next run reads the tree from the disk. Gives up on cold runs when it can't.
+ */
+void DropCaches()
+{
+    int file_desc;
+
+    sync();
+    file_desc = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if(file_desc < 0 || write(file_desc, "3\n", 2) != 2)
+    {
+        perror("Error in dropping caches, runs are warm");
+        ColdCache = 0;
+    }
+    if(file_desc >= 0)
+    {
+        close(file_desc);
+    }
+}
+
+int RemoveEntry(const char *path, const struct stat *info, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+/*
+ * Running pfind once. Returns the wall time, and the number of matches from its last line.
+ */
+double RunPfind(char *root, char *pattern, int threads, int uring, long *matches)
+{
+    char threads_arg[16], uring_arg[32];
+    char *output = NULL;
+    size_t length = 0, size = 0;
+    int pipe_fds[2], status;
+    ssize_t got;
+    double start;
+    pid_t pid;
+
+    snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+    snprintf(uring_arg, sizeof(uring_arg), "--uring=%d", uring);
+    if(ColdCache)
+    {
+        DropCaches();
+    }
+    start = NowSeconds();
+    if(pipe(pipe_fds) < 0)
+    {
+        perror("Error in pipe");
+        exit(1);
+    }
+
+    pid = fork();
+    if(pid < 0)
+    {
+        perror("Failed to conduct fork() function.");
+        exit(1);
+    }
+    if(pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        if(uring > 0)
+            execl(PfindPath, PfindPath, uring_arg, root, pattern, threads_arg, (char *)NULL);
+        else
+            execl(PfindPath, PfindPath, root, pattern, threads_arg, (char *)NULL);
+        _exit(127);
+    }
+
+    //Matches go through the pipe too, so printing them is part of the measured time.
+    close(pipe_fds[1]);
+    do
+    {
+        if(size - length < OUTPUT_CHUNK)
+        {
+            size = size * 2 + OUTPUT_CHUNK;
+            output = realloc(output, size);
+            if(output == NULL)
+            {
+                fprintf(stderr, "Error in allocating output.\n");
+                exit(1);
+            }
+        }
+        got = read(pipe_fds[0], output + length, size - length - 1);
+        if(got > 0)
+        {
+            length += got;
+        }
+    }while(got > 0 || (got < 0 && errno == EINTR));
+    close(pipe_fds[0]);
+    waitpid(pid, &status, 0);
+    start = NowSeconds() - start;
+
+    output[length] = '\0';
+    char *last = strstr(output, "Done searching, found ");
+    if(!WIFEXITED(status) || WEXITSTATUS(status) == 127 || last == NULL)
+    {
+        fprintf(stderr, "pfind failed with %d threads.\n", threads);
+        exit(1);
+    }
+    *matches = atol(last + strlen("Done searching, found "));
+    free(output);
+    return start;
+}
+
+/*
+ * Best wall time of Runs runs. Every run must find as many matches as the first one did.
+ */
+double BestOf(char *root, char *pattern, int threads, int uring, long *expected)
+{
+    double best = 0;
+    long matches = 0;
+
+    for(int run = 0; run < Runs; run++)
+    {
+        double seconds = RunPfind(root, pattern, threads, uring, &matches);
+        if(run == 0 || seconds < best)
+        {
+            best = seconds;
+        }
+        if(*expected >= 0 && matches != *expected)
+        {
+            fprintf(stderr, "Warning: %d threads%s found %ld matches, 1 thread found %ld.\n",
+                    threads, uring > 0 ? " with io_uring" : "", matches, *expected);
+        }
+        *expected = *expected < 0 ? matches : *expected;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    char generated[] = "/tmp/pfind_bench_XXXXXX";
+    char *root = NULL, *pattern = DEFAULT_PATTERN;
+    double base = 0;
+    long expected = -1;
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:t:r:g:u:c")) != -1)
+    {
+        switch(opt)
+        {
+            case 'p':
+                PfindPath = optarg;
+                break;
+            case 't':
+                MaxThreads = atoi(optarg);
+                break;
+            case 'r':
+                Runs = atoi(optarg);
+                break;
+            case 'g':
+                if(sscanf(optarg, "%d:%d:%d", &TreeDepth, &TreeFanout, &TreeFiles) != 3)
+                {
+                    fprintf(stderr, "Error in tree shape, expected depth:fanout:files.\n");
+                    exit(1);
+                }
+                break;
+            case 'u':
+                UringDepth = atoi(optarg);
+                break;
+            case 'c':
+                ColdCache = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p pfind] [-t max threads] [-r runs] [-g depth:fanout:files] [-u depth] [-c] [root] [pattern]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if(optind < argc)
+    {
+        root = argv[optind++];
+    }
+    if(optind < argc)
+    {
+        pattern = argv[optind++];
+    }
+    if(MaxThreads <= 0 || Runs <= 0 || TreeDepth < 0 || TreeFanout <= 0 || TreeFiles < 0 || UringDepth < 0)
+    {
+        fprintf(stderr, "Error in benchmark arguments.\n");
+        exit(1);
+    }
+
+    if(root == NULL)
+    {
+        if(mkdtemp(generated) == NULL)
+        {
+            perror("Error in creating tree");
+            exit(1);
+        }
+        GenerateTree(generated, TreeDepth);
+        root = generated;
+    }
+
+    if(ColdCache)
+    {
+        DropCaches(); //Finding out early whether cold runs are possible.
+    }
+    printf("%s on %s, pattern \"%s\", best of %d %s runs\n", PfindPath, root, pattern, Runs, ColdCache ? "cold" : "warm");
+    printf(UringDepth > 0 ? "threads  seconds  speedup    uring  vs threads  matches\n" : "threads  seconds  speedup  matches\n");
+    for(int threads = 1; threads <= MaxThreads; threads = threads < MaxThreads && threads * 2 > MaxThreads ? MaxThreads : threads * 2)
+    {
+        //Powers of 2, then MaxThreads itself.
+        double best = BestOf(root, pattern, threads, 0, &expected);
+        if(threads == 1)
+        {
+            base = best;
+        }
+        printf("%7d  %7.3f  %7.2f", threads, best, base / best);
+        if(UringDepth > 0)
+        {
+            double uring = BestOf(root, pattern, threads, UringDepth, &expected);
+            printf("  %7.3f  %10.2f", uring, best / uring);
+        }
+        printf("  %ld\n", expected);
+        fflush(stdout);
+    }
+
+    if(root == generated)
+    {
+        nftw(generated, RemoveEntry, 64, FTW_DEPTH | FTW_PHYS);
+    }
+    return 0;
+}